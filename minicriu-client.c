@@ -41,16 +41,55 @@
 #include <sys/syscall.h>      /* Definition of SYS_* constants */
 #include <sys/prctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/ucontext.h>
 #include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "minicriu-client.h"
+#include "minicriu-placement.h"
 
 #define MC_THREAD_SIG SIGSYS
 
 static volatile uint32_t mc_futex_checkpoint;
 static volatile uint32_t mc_futex_restore;
+static volatile uint32_t mc_futex_resumed;
+/* set once the restorer is gone, threads wait for it before leaving */
+static volatile uint32_t mc_futex_released;
 
-static void mc_sighnd(int sig);
+struct mc_map {
+	unsigned long start, end;
+	/* file of the mapping, 0 for anonymous memory; kept by snapshots only */
+	unsigned long ino, off;
+	int prot;
+};
+
+/* mappings of the process at checkpoint, ascending, grown as needed */
+static struct mc_map *mc_maps;
+static int mc_maps_n, mc_maps_cap;
+
+/* mappings a snapshot keeps track of */
+#define MC_MAX_MAPS 4096
+/* parts of mappings unmapped after a walk of the maps */
+#define MC_UNMAP_BATCH 256
+
+static struct mc_placement mc_placement;
+
+/*
+ * soft-dirty bits were cleared at checkpoint, so they track new writes.
+ * Snapshots clear the same bits, and the other way around.
+ */
+static int mc_dirty_tracked;
+
+/* rough throughput of the kernel writing a core */
+#define MC_DUMP_BYTES_PER_SEC (512UL << 20)
+/* notes of a thread: prstatus, fpregs, xstate, siginfo */
+#define MC_THREAD_NOTES 4096
+
+static void mc_sighnd(int sig, siginfo_t *info, void *uc);
+static void mc_snap_sighnd(ucontext_t *uc);
+static void mc_snap_untrack(void);
 
 struct savedctx {
 	unsigned long fsbase, gsbase;
@@ -66,6 +105,10 @@ struct savedctx {
 	asm volatile("wrgsbase %0" : : "r" (ctx.gsbase) : "memory"); \
 } while(0)
 
+static unsigned long align_up(unsigned long v, unsigned p) {
+	return (v + p - 1) & ~(p - 1);
+}
+
 static pid_t* gettid_ptr(pthread_t thr) {
 	const size_t header_size =
 #if defined(__x86_64__)
@@ -102,10 +145,446 @@ static int writefile(const char *file, const char *buf, size_t len) {
 	return bytes;
 }
 
+/*
+ * Calls fn for each line of /proc/self/maps. No stdio, so it can run
+ * right after restore, when the brk heap is still the restorer's.
+ */
+static int foreach_map(void (*fn)(unsigned long start, unsigned long end,
+			const char *line, void *arg), void *arg) {
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	char buf[4096 + 1];
+	size_t len = 0;
+	int bytes;
+	while (0 < (bytes = read(fd, buf + len, sizeof(buf) - 1 - len))) {
+		len += bytes;
+		buf[len] = '\0';
+		char *line = buf, *nl;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = '\0';
+			char *p;
+			unsigned long start = strtoul(line, &p, 16);
+			unsigned long end = strtoul(p + 1, NULL, 16);
+			fn(start, end, line, arg);
+			line = nl + 1;
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+	close(fd);
+	return bytes < 0 ? -errno : 0;
+}
+
+static void save_map(unsigned long start, unsigned long end, const char *line, void *arg) {
+	if (mc_maps_n < mc_maps_cap) {
+		mc_maps[mc_maps_n] = (struct mc_map) { start, end };
+	}
+	++mc_maps_n;
+}
+
+/*
+ * Saves the mappings of the process. The table is mapped before the walk,
+ * so it is one of them, and is mapped bigger until all fit.
+ */
+static int save_maps(void) {
+	int cap = mc_maps_cap ? mc_maps_cap : MC_MAX_MAPS;
+	while (1) {
+		if (mc_maps) {
+			munmap(mc_maps, align_up(mc_maps_cap * sizeof(*mc_maps), 4096));
+		}
+		mc_maps = mmap(NULL, align_up(cap * sizeof(*mc_maps), 4096), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mc_maps == MAP_FAILED) {
+			mc_maps = NULL;
+			mc_maps_cap = 0;
+			return -ENOMEM;
+		}
+		mc_maps_cap = cap;
+		mc_maps_n = 0;
+		int err = foreach_map(save_map, NULL);
+		if (err || mc_maps_n <= mc_maps_cap) {
+			return err;
+		}
+		cap = 2 * mc_maps_n;
+	}
+}
+
+struct mc_unmap {
+	/* mappings to keep, ascending */
+	const struct mc_map *maps;
+	int maps_n;
+	/* a mapping of other file or offset over one to keep is new as well */
+	int files;
+	struct mc_map map[MC_UNMAP_BATCH];
+	int n;
+	/* did not fit in map */
+	int more;
+	/* end of the mapping walked last */
+	unsigned long last;
+};
+
+static void unmap_add(struct mc_unmap *u, unsigned long start, unsigned long end, int prot) {
+	if (u->n < MC_UNMAP_BATCH) {
+		u->map[u->n++] = (struct mc_map) { start, end, .prot = prot };
+	} else {
+		u->more = 1;
+	}
+}
+
+/* Reads the file offset and the inode of a line of the maps. */
+static void map_file(const char *line, unsigned long *off, unsigned long *ino) {
+	/* start-end perms offset dev inode path */
+	const char *p = strchr(line, ' ');
+	p = p ? strchr(p + 1, ' ') : NULL;
+	*off = p ? strtoul(p + 1, (char **)&p, 16) : 0;
+	p = p ? strchr(p + 1, ' ') : NULL;
+	*ino = p ? strtoul(p + 1, NULL, 10) : 0;
+}
+
+/* Tells if a mapping starting at start is still the one m was part of. */
+static int map_same(const struct mc_map *m, unsigned long start, unsigned long off, unsigned long ino) {
+	return m->ino == ino && (!ino || off - start == m->off - m->start);
+}
+
+/* Collects parts of a mapping that are not in u->maps. */
+static void find_new_map(unsigned long start, unsigned long end, const char *line, void *arg) {
+	struct mc_unmap *u = arg;
+	if (strstr(line, "[vdso]") || strstr(line, "[vvar") || strstr(line, "[vsyscall]")) {
+		return;
+	}
+	unsigned long off = 0, ino = 0;
+	if (u->files) {
+		map_file(line, &off, &ino);
+	}
+	unsigned long cur = start;
+	for (int i = 0; i < u->maps_n && cur < end; ++i) {
+		const struct mc_map *m = &u->maps[i];
+		if (m->end <= cur || end <= m->start) {
+			continue;
+		}
+		if (cur < m->start) {
+			unmap_add(u, cur, m->start, 0);
+		}
+		if (u->files && !map_same(m, start, off, ino)) {
+			unmap_add(u, cur < m->start ? m->start : cur, end < m->end ? end : m->end, 0);
+		}
+		cur = m->end;
+	}
+	if (cur < end) {
+		unmap_add(u, cur, end, 0);
+	}
+}
+
+/*
+ * Unmaps all parts of mappings that are not in u->maps, a batch per walk
+ * of the maps. Returns -errno if the maps cannot be read, or the number
+ * of parts that could not be unmapped. No stdio.
+ */
+static int unmap_new(struct mc_unmap *u) {
+	int failed = 0;
+	do {
+		u->n = 0;
+		u->more = 0;
+		int err = foreach_map(find_new_map, u);
+		if (err) {
+			return err;
+		}
+		int unmapped = 0;
+		for (int i = 0; i < u->n; ++i) {
+			if (munmap((void *)u->map[i].start, u->map[i].end - u->map[i].start)) {
+				++failed;
+			} else {
+				++unmapped;
+			}
+		}
+		/* the next walk finds the same, unless some are gone */
+		if (!unmapped) {
+			break;
+		}
+	} while (u->more);
+	return failed;
+}
+
+/*
+ * Unmaps everything the restorer left behind: its code, data, heap and
+ * stacks. Must be called once no thread is executing the restorer, and
+ * before any returns to the application, which could map memory meanwhile.
+ */
+static void release_restorer(void) {
+	static struct mc_unmap u;
+	u.maps = mc_maps;
+	u.maps_n = mc_maps_n;
+	int err = unmap_new(&u);
+	if (err < 0) {
+		fprintf(stderr, "WARN: restorer left mapped, read maps: %s\n", strerror(-err));
+	} else if (err) {
+		fprintf(stderr, "WARN: %d parts of the restorer left mapped\n", err);
+	}
+}
+
+static void save_thread_placement(void) {
+	int i = __atomic_fetch_add(&mc_placement.nthreads, 1, __ATOMIC_SEQ_CST);
+	if (MC_PLACEMENT_THREADS <= i) {
+		return;
+	}
+	struct mc_thread_placement *t = &mc_placement.threads[i];
+	struct sched_param param = { 0 };
+
+	t->tid = syscall(SYS_gettid);
+	t->policy = sched_getscheduler(0);
+	sched_getparam(0, &param);
+	t->priority = param.sched_priority;
+	errno = 0;
+	t->nice = getpriority(PRIO_PROCESS, t->tid);
+	if (errno) {
+		t->nice = 0;
+	}
+	if (sched_getaffinity(0, sizeof(t->affinity), &t->affinity)) {
+		CPU_ZERO(&t->affinity);
+	}
+	if (syscall(SYS_get_mempolicy, &t->mempolicy, t->nodes, MC_MAX_NODES, NULL, 0)) {
+		t->mempolicy = -1;
+	}
+}
+
+/* Finds the node that holds most of the sampled resident pages. */
+static int region_node(unsigned long start, unsigned long end) {
+	enum { SAMPLES = 64 };
+	void *pages[SAMPLES];
+	int status[SAMPLES];
+	unsigned long step = (end - start) / SAMPLES;
+	step = step < 4096 ? 4096 : step & ~4095UL;
+
+	int n = 0;
+	for (unsigned long a = start; a < end && n < SAMPLES; a += step) {
+		pages[n++] = (void *)a;
+	}
+	/* no target nodes: only query where the pages are */
+	if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0)) {
+		return -1;
+	}
+
+	int best = -1, bestcnt = 0;
+	for (int i = 0; i < n; ++i) {
+		int cnt = 0;
+		for (int j = 0; j < n; ++j) {
+			cnt += status[j] == status[i];
+		}
+		if (0 <= status[i] && bestcnt < cnt) {
+			best = status[i];
+			bestcnt = cnt;
+		}
+	}
+	return best;
+}
+
+static void save_region_placement(unsigned long start, unsigned long end, const char *line, void *arg) {
+	if (MC_PLACEMENT_REGIONS <= mc_placement.nregions ||
+			strstr(line, "[vdso]") || strstr(line, "[vvar") || strstr(line, "[vsyscall]")) {
+		return;
+	}
+	struct mc_region_placement *r = &mc_placement.regions[mc_placement.nregions++];
+	r->start = start;
+	r->end = end;
+	if (syscall(SYS_get_mempolicy, &r->mempolicy, r->nodes, MC_MAX_NODES, start, MPOL_F_ADDR)) {
+		r->mempolicy = -1;
+	}
+	r->node = region_node(start, end);
+}
+
+#define PM_SOFT_DIRTY (1UL << 55)
+#define PM_FILE (1UL << 61)
+#define PM_SWAP (1UL << 62)
+#define PM_PRESENT (1UL << 63)
+
+/* bits of /proc/self/coredump_filter */
+#define MC_FILTER_ANON_PRIVATE (1 << 0)
+#define MC_FILTER_ANON_SHARED (1 << 1)
+#define MC_FILTER_MAPPED_PRIVATE (1 << 2)
+#define MC_FILTER_MAPPED_SHARED (1 << 3)
+#define MC_FILTER_ELF_HEADERS (1 << 4)
+
+struct mc_dirty {
+	int fd;
+	int mem;
+	unsigned filter;
+	unsigned long pages;
+	/* size of the image, and what of it is written, not skipped as holes */
+	unsigned long bytes;
+	unsigned long written;
+};
+
+/*
+ * Walks pagemap of a mapping. Counts its dirty pages if asked to, and its
+ * resident and swapped pages, which are what the kernel writes of
+ * anonymous memory. *anon tells if the mapping has anonymous pages, which
+ * is what makes the kernel dump it as a whole. Without dirty or count,
+ * stops at the first anonymous page.
+ */
+static unsigned long scan_pages(struct mc_dirty *d, unsigned long start, unsigned long end,
+		int dirty, int count, int *anon) {
+	uint64_t pm[512];
+	unsigned long resident = 0;
+	*anon = 0;
+	for (unsigned long a = start; a < end && (dirty || count || !*anon); ) {
+		size_t n = (end - a) / 4096;
+		n = n < 512 ? n : 512;
+		ssize_t r = pread(d->fd, pm, n * sizeof(pm[0]), a / 4096 * sizeof(pm[0]));
+		if (r <= 0) {
+			break;
+		}
+		n = r / sizeof(pm[0]);
+		for (size_t i = 0; i < n; ++i) {
+			*anon |= (pm[i] & PM_SWAP) || (pm[i] & (PM_PRESENT | PM_FILE)) == PM_PRESENT;
+			resident += !!(pm[i] & (PM_PRESENT | PM_SWAP));
+			if (dirty) {
+				d->pages += mc_dirty_tracked ?
+					!!(pm[i] & PM_SOFT_DIRTY) :
+					!!(pm[i] & (PM_PRESENT | PM_SWAP));
+			}
+		}
+		a += n * 4096;
+	}
+	return resident;
+}
+
+/* Bytes of a file mapping backed by the file, which the kernel reads in to dump. */
+static unsigned long file_bytes(const char *path, unsigned long off, unsigned long size) {
+	struct stat st;
+	if (stat(path, &st)) {
+		return size;
+	}
+	if (st.st_size <= off) {
+		return 0;
+	}
+	unsigned long len = align_up(st.st_size - off, 4096);
+	return len < size ? len : size;
+}
+
+/* Adds what the kernel would dump of a mapping, after its vma_dump_size(). */
+static void count_map(unsigned long start, unsigned long end, const char *line, void *arg) {
+	struct mc_dirty *d = arg;
+	char perms[5];
+	unsigned long off, inode;
+	int pathpos = 0;
+	if (sscanf(line, "%*lx-%*lx %4s %lx %*s %lu %n", perms, &off, &inode, &pathpos) < 3) {
+		return;
+	}
+	const char *path = pathpos ? line + pathpos : "";
+	int private = perms[3] == 'p';
+	if (private && !strncmp(perms, "---", 3)) {
+		/* an address space reservation, taken as never written */
+		return;
+	}
+	int anon = 0;
+	unsigned long resident = 0;
+	if (private) {
+		/* only private writable mappings change the image */
+		resident = scan_pages(d, start, end, perms[1] == 'w', !inode, &anon);
+	}
+
+	unsigned long size = end - start, dump = 0, written = 0;
+	char magic[4];
+	if (!strcmp(path, "[vdso]") || !strcmp(path, "[vsyscall]") || !strncmp(path, "[vvar", 5)) {
+		dump = written = size;
+	} else if (!private) {
+		unsigned bit = strstr(path, " (deleted)") || !inode ?
+			MC_FILTER_ANON_SHARED : MC_FILTER_MAPPED_SHARED;
+		dump = written = d->filter & bit ? size : 0;
+	} else if (anon && (d->filter & MC_FILTER_ANON_PRIVATE)) {
+		dump = size;
+		written = inode ? file_bytes(path, off, size) : resident * 4096;
+	} else if (!inode) {
+		/* anonymous memory never written */
+	} else if (d->filter & MC_FILTER_MAPPED_PRIVATE) {
+		dump = size;
+		written = file_bytes(path, off, size);
+	} else if ((d->filter & MC_FILTER_ELF_HEADERS) && off == 0 && perms[0] == 'r' &&
+			pread(d->mem, magic, sizeof(magic), start) == sizeof(magic) &&
+			!memcmp(magic, "\177ELF", sizeof(magic))) {
+		/* a file shorter than the mapping would fault, so not read directly */
+		dump = written = 4096;
+	}
+	d->bytes += dump;
+	d->written += written;
+}
+
+/*
+ * Starts tracking writes since this point. Kernels without soft-dirty
+ * accept the clear but never set the bit, so a probe write tells.
+ */
+static int clear_soft_dirty(void) {
+	static volatile char probe[4096];
+	if (writefile("/proc/self/clear_refs", "4", 1) != 1) {
+		return 0;
+	}
+	probe[0] = 1;
+
+	uint64_t pm = 0;
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	pread(fd, &pm, sizeof(pm), (uintptr_t)probe / 4096 * sizeof(pm));
+	close(fd);
+	return !!(pm & PM_SOFT_DIRTY);
+}
+
+int minicriu_estimate(struct minicriu_estimate *est) {
+	char buf[32];
+	int len = readfile("/proc/self/coredump_filter", buf, sizeof(buf) - 1);
+	if (len < 0) {
+		fprintf(stderr, "read coredump_filter: %s\n", strerror(-len));
+		return 1;
+	}
+	buf[len] = '\0';
+
+	pid_t mytid = syscall(SYS_gettid);
+	est->threads = 0;
+	DIR* tasksdir = opendir("/proc/self/task/");
+	if (!tasksdir) {
+		perror("opendir task");
+		return 1;
+	}
+	struct dirent *taskdent;
+	while ((taskdent = readdir(tasksdir))) {
+		int tid = atoi(taskdent->d_name);
+		if (taskdent->d_name[0] != '.' && tid != mytid) {
+			++est->threads;
+		}
+	}
+	closedir(tasksdir);
+
+	struct mc_dirty d = {
+		.fd = open("/proc/self/pagemap", O_RDONLY),
+		.mem = open("/proc/self/mem", O_RDONLY),
+		.filter = strtoul(buf, NULL, 16),
+	};
+	if (d.fd < 0) {
+		perror("open pagemap");
+		close(d.mem);
+		return 1;
+	}
+	int err = foreach_map(count_map, &d);
+	close(d.fd);
+	close(d.mem);
+	if (err) {
+		fprintf(stderr, "read maps: %s\n", strerror(-err));
+		return 1;
+	}
+	est->dirty_pages = d.pages;
+	unsigned long notes = (est->threads + 2) * MC_THREAD_NOTES;
+	est->image_size = d.bytes + notes;
+	/* holes are skipped, not written */
+	est->dump_time_us = (d.written + notes) / (MC_DUMP_BYTES_PER_SEC / 1000000);
+	return 0;
+}
+
 int minicriu_dump(void) {
 
 	pid_t mytid = syscall(SYS_gettid);
-	pid_t mypid = getpid();
 
 	printf("minicriu thread %d\n", mytid);
 
@@ -124,7 +603,18 @@ int minicriu_dump(void) {
 	struct savedctx ctx;
 	SAVE_CTX(ctx);
 
-	struct sigaction newhnd = { .sa_handler = mc_sighnd };
+	mc_futex_restore = 0;
+	mc_futex_resumed = 0;
+	mc_futex_released = 0;
+
+	mc_placement.nthreads = 0;
+	mc_placement.nregions = 0;
+	save_thread_placement();
+
+	struct sigaction newhnd = {
+		.sa_sigaction = mc_sighnd,
+		.sa_flags = SA_SIGINFO | SA_ONSTACK,
+	};
 	struct sigaction oldhnd;
 
 	if (sigaction(MC_THREAD_SIG, &newhnd, &oldhnd)) {
@@ -132,6 +622,7 @@ int minicriu_dump(void) {
 		return 1;
 	}
 
+	int nthreads = 0;
 	DIR* tasksdir = opendir("/proc/self/task/");
 	struct dirent *taskdent;
 	while ((taskdent = readdir(tasksdir))) {
@@ -143,12 +634,9 @@ int minicriu_dump(void) {
 		if (tid == mytid) {
 			continue;
 		}
-		if (tid == mypid) {
-			/* don't touch premodorial thread */
-			continue;
-		}
 		int r = syscall(SYS_tkill, tid, MC_THREAD_SIG);
 		__atomic_fetch_sub(&mc_futex_checkpoint, 1, __ATOMIC_SEQ_CST);
+		++nthreads;
 	}
 	closedir(tasksdir);
 
@@ -169,8 +657,16 @@ int minicriu_dump(void) {
 
 	acts[MC_THREAD_SIG] = oldhnd;
 
+	int maperr = save_maps();
+	if (maperr) {
+		fprintf(stderr, "read maps: %s\n", strerror(-maperr));
+	}
+
+	foreach_map(save_region_placement, NULL);
+	mc_placement.magic = MC_PLACEMENT_MAGIC;
+
 	pid_t pid = syscall(SYS_getpid);
-	syscall(SYS_kill, mytid, SIGABRT, 1313, mytid);
+	syscall(SYS_kill, mytid, SIGABRT, 1313, mytid, &mc_placement);
 
 	RESTORE_CTX(ctx);
 
@@ -241,6 +737,22 @@ int minicriu_dump(void) {
 	mc_futex_restore = 1;
 	syscall(SYS_futex, &mc_futex_restore, FUTEX_WAKE, INT_MAX);
 
+	/* no application code runs until the restorer is unmapped */
+	while ((current_count = mc_futex_resumed) != nthreads) {
+		syscall(SYS_futex, &mc_futex_resumed, FUTEX_WAIT, current_count);
+	}
+	if (!maperr) {
+		release_restorer();
+	} else {
+		fprintf(stderr, "WARN: restorer left mapped, the maps at checkpoint are unknown\n");
+	}
+
+	mc_futex_released = 1;
+	syscall(SYS_futex, &mc_futex_released, FUTEX_WAKE, INT_MAX);
+
+	mc_dirty_tracked = clear_soft_dirty();
+	mc_snap_untrack();
+
 	volatile int thread_loop = 0;
 	while (thread_loop);
 
@@ -248,7 +760,627 @@ int minicriu_dump(void) {
 }
 
 
-static void mc_sighnd(int sig) {
+/*
+ * In-memory snapshots. Their state lives in a mapping of its own that is
+ * left out of the snapshot, as are the alternate signal stacks the
+ * threads are stopped on, so a rollback does not overwrite either.
+ */
+
+#define MC_ALTSTACK_SIZE (64 * 1024)
+#define MC_SNAP_THREADS 128
+#define MC_SNAP_REGIONS 1024
+#define MC_FPSTATE_MAX (16 * 1024)
+/* marks fpregs of a signal frame followed by XSAVE state */
+#define MC_FP_XSTATE_MAGIC1 0x46505853U
+
+enum { MC_SNAP_IDLE, MC_SNAP_TAKE, MC_SNAP_ROLLBACK };
+
+struct mc_snap_thread {
+	pid_t tid;
+	unsigned long altstack, altstack_end;
+	ucontext_t uc;
+	size_t fpsize;
+	char fp[MC_FPSTATE_MAX];
+};
+
+struct mc_snap_region {
+	unsigned long start, end;
+	int prot;
+	/* offsets in copy of the content and of the bitmap of saved pages */
+	size_t data, saved;
+};
+
+struct mc_snap {
+	/* held from mc_snap_run() until the caller leaves the handler */
+	volatile uint32_t busy;
+	volatile int mode;
+	int valid;
+	volatile int err;
+	pid_t caller;
+	/* thread that took the snapshot, its minicriu_snapshot() returns 1 */
+	pid_t taker;
+	int nthreads;
+	int nsnap;
+	volatile uint32_t arrived, release, left;
+	/* soft-dirty bits tell pages written since the snapshot */
+	int tracked;
+	char *copy;
+	size_t copysz;
+	struct sigaction oldhnd;
+	struct mc_snap_thread threads[MC_SNAP_THREADS];
+	int nregions;
+	struct mc_snap_region regions[MC_SNAP_REGIONS];
+	/* all mappings at snapshot, ascending */
+	int nmaps;
+	struct mc_map maps[MC_MAX_MAPS];
+	struct mc_unmap unmap;
+};
+
+static struct mc_snap *mc_snap;
+
+static void mc_snap_error(const char *msg) {
+	write(STDERR_FILENO, msg, strlen(msg));
+	mc_snap->err = 1;
+}
+
+/* No errno: other threads may have their TLS rolled back meanwhile. */
+static long mc_futex(volatile uint32_t *f, int op, uint32_t val) {
+	register long timeout asm("r10") = 0;
+	long ret;
+	asm volatile (
+		"syscall\n\t"
+		: "=a"(ret)
+		: "a"(SYS_futex), "D"(f), "S"(op), "d"(val), "r"(timeout)
+		: "rcx", "r11", "memory");
+	return ret;
+}
+
+static void mc_wait_for(volatile uint32_t *f, uint32_t val) {
+	uint32_t cur;
+	while ((cur = *f) != val) {
+		mc_futex(f, FUTEX_WAIT, cur);
+	}
+}
+
+static void mc_inc_wake(volatile uint32_t *f) {
+	__atomic_fetch_add(f, 1, __ATOMIC_SEQ_CST);
+	mc_futex(f, FUTEX_WAKE, INT_MAX);
+}
+
+static pthread_key_t mc_altstack_key;
+static pthread_once_t mc_altstack_once = PTHREAD_ONCE_INIT;
+
+/* Drops the altstack of an exiting thread. */
+static void mc_altstack_free(void *sp) {
+	stack_t ss = { .ss_flags = SS_DISABLE };
+	if (!sigaltstack(&ss, NULL)) {
+		munmap(sp, MC_ALTSTACK_SIZE);
+	}
+}
+
+static void mc_altstack_init(void) {
+	if (pthread_key_create(&mc_altstack_key, mc_altstack_free)) {
+		perror("pthread_key_create");
+	}
+}
+
+static int mc_altstack(void) {
+	stack_t ss;
+	if (sigaltstack(NULL, &ss)) {
+		perror("sigaltstack");
+		return 1;
+	}
+	if (!(ss.ss_flags & SS_DISABLE)) {
+		return 0;
+	}
+	pthread_once(&mc_altstack_once, mc_altstack_init);
+	ss.ss_sp = mmap(NULL, MC_ALTSTACK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ss.ss_sp == MAP_FAILED) {
+		perror("mmap altstack");
+		return 1;
+	}
+	ss.ss_size = MC_ALTSTACK_SIZE;
+	ss.ss_flags = 0;
+	if (sigaltstack(&ss, NULL)) {
+		perror("sigaltstack");
+		munmap(ss.ss_sp, MC_ALTSTACK_SIZE);
+		return 1;
+	}
+	/* unmapped by mc_altstack_free() as the thread exits */
+	pthread_setspecific(mc_altstack_key, ss.ss_sp);
+	return 0;
+}
+
+static size_t mc_fpsize(const ucontext_t *uc) {
+	if (!uc->uc_mcontext.fpregs) {
+		return 0;
+	}
+	const uint32_t *sw = (const uint32_t *)((const char *)uc->uc_mcontext.fpregs + 464);
+	return sw[0] == MC_FP_XSTATE_MAGIC1 ? sw[1] : 512;
+}
+
+/* Adds a region to save, less the snapshot state and the altstacks. */
+static void snap_add(struct mc_snap *s, unsigned long start, unsigned long end, int prot) {
+	for (int i = -1; i < s->nsnap; ++i) {
+		unsigned long a = i < 0 ? (unsigned long)s : s->threads[i].altstack;
+		unsigned long b = i < 0 ? a + align_up(sizeof(*s), 4096) : s->threads[i].altstack_end;
+		if (a < end && start < b) {
+			if (start < a) {
+				snap_add(s, start, a, prot);
+			}
+			if (b < end) {
+				snap_add(s, b, end, prot);
+			}
+			return;
+		}
+	}
+	if (s->nregions < MC_SNAP_REGIONS) {
+		s->regions[s->nregions++] = (struct mc_snap_region) { start, end, prot };
+	} else {
+		mc_snap_error("minicriu: too many regions to snapshot\n");
+	}
+}
+
+static void snap_collect(unsigned long start, unsigned long end, const char *line, void *arg) {
+	struct mc_snap *s = arg;
+	const char *perms = strchr(line, ' ');
+	if (!perms) {
+		return;
+	}
+	struct mc_map m = { start, end };
+	map_file(line, &m.off, &m.ino);
+	m.prot = (perms[1] == 'r' ? PROT_READ : 0) | (perms[2] == 'w' ? PROT_WRITE : 0) |
+		(perms[3] == 'x' ? PROT_EXEC : 0);
+	if (s->nmaps < MC_MAX_MAPS) {
+		s->maps[s->nmaps++] = m;
+	} else {
+		mc_snap_error("minicriu: too many mappings to snapshot\n");
+	}
+
+	/* shared and read-only memory is left as it is */
+	if (perms[2] == 'w' && perms[4] == 'p') {
+		snap_add(s, start, end, m.prot);
+	}
+}
+
+/*
+ * Anonymous private memory a rollback can map back if it is gone: the
+ * writable, as the snapshot has its content, and the inaccessible.
+ */
+static int map_recreatable(const struct mc_map *m) {
+	return !m->ino && (!m->prot || (m->prot & PROT_WRITE));
+}
+
+struct snap_check {
+	const struct mc_snap *s;
+	unsigned long last;
+	int changed;
+};
+
+static void snap_check_gone(struct snap_check *c, unsigned long start, unsigned long end) {
+	for (int i = 0; i < c->s->nmaps; ++i) {
+		const struct mc_map *m = &c->s->maps[i];
+		if (m->start < end && start < m->end && !map_recreatable(m)) {
+			c->changed = 1;
+		}
+	}
+}
+
+/* Finds mappings a rollback cannot bring back that are gone or replaced. */
+static void snap_check_map(unsigned long start, unsigned long end, const char *line, void *arg) {
+	struct snap_check *c = arg;
+	snap_check_gone(c, c->last, start);
+	c->last = end;
+
+	unsigned long off, ino;
+	map_file(line, &off, &ino);
+	for (int i = 0; i < c->s->nmaps; ++i) {
+		const struct mc_map *m = &c->s->maps[i];
+		if (m->start < end && start < m->end && !map_same(m, start, off, ino) &&
+				!map_recreatable(m)) {
+			c->changed = 1;
+		}
+	}
+}
+
+/* Collects parts of recreatable mappings of u->maps that are not mapped. */
+static void find_gone_map(unsigned long start, unsigned long end, const char *line, void *arg) {
+	struct mc_unmap *u = arg;
+	for (int i = 0; i < u->maps_n; ++i) {
+		const struct mc_map *m = &u->maps[i];
+		unsigned long a = u->last < m->start ? m->start : u->last;
+		unsigned long b = start < m->end ? start : m->end;
+		if (a < b && map_recreatable(m)) {
+			unmap_add(u, a, b, m->prot);
+		}
+	}
+	u->last = end;
+}
+
+static int snap_take(struct mc_snap *s) {
+	if (s->copy) {
+		munmap(s->copy, s->copysz);
+		s->copy = NULL;
+	}
+	s->nmaps = 0;
+	s->nregions = 0;
+	if (foreach_map(snap_collect, s) || s->err) {
+		return 1;
+	}
+
+	size_t size = 0;
+	for (int i = 0; i < s->nregions; ++i) {
+		struct mc_snap_region *r = &s->regions[i];
+		r->data = size;
+		size += r->end - r->start;
+	}
+	for (int i = 0; i < s->nregions; ++i) {
+		struct mc_snap_region *r = &s->regions[i];
+		r->saved = size;
+		size += align_up((r->end - r->start) / 4096 / 8 + 1, 8);
+	}
+	size = align_up(size, 4096);
+	s->copy = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (s->copy == MAP_FAILED) {
+		s->copy = NULL;
+		mc_snap_error("minicriu: cannot map snapshot copy\n");
+		return 1;
+	}
+	s->copysz = size;
+
+	/* the copy is not a mapping to drop on rollback */
+	int at = 0;
+	while (at < s->nmaps && s->maps[at].start < (unsigned long)s->copy) {
+		++at;
+	}
+	if (s->nmaps == MC_MAX_MAPS) {
+		mc_snap_error("minicriu: too many mappings to snapshot\n");
+		return 1;
+	}
+	memmove(&s->maps[at + 1], &s->maps[at], (s->nmaps - at) * sizeof(s->maps[0]));
+	s->maps[at] = (struct mc_map) { (unsigned long)s->copy, (unsigned long)s->copy + size,
+		.prot = PROT_READ | PROT_WRITE };
+	s->nmaps++;
+
+	int pm = open("/proc/self/pagemap", O_RDONLY);
+	if (pm < 0) {
+		mc_snap_error("minicriu: cannot open pagemap\n");
+		return 1;
+	}
+	/* the bits are cleared below, so the copy does not claim them either */
+	mc_dirty_tracked = 0;
+
+	/* only pages with content, the rest is zero or the file as it was */
+	for (int i = 0; i < s->nregions; ++i) {
+		const struct mc_snap_region *r = &s->regions[i];
+		uint8_t *saved = (uint8_t *)s->copy + r->saved;
+		uint64_t ent[512];
+		size_t npages = (r->end - r->start) / 4096;
+		for (size_t p = 0; p < npages; p += 512) {
+			size_t n = npages - p < 512 ? npages - p : 512;
+			if (pread(pm, ent, n * sizeof(ent[0]), (r->start / 4096 + p) * sizeof(ent[0])) !=
+					n * sizeof(ent[0])) {
+				close(pm);
+				mc_snap_error("minicriu: cannot read pagemap\n");
+				return 1;
+			}
+			for (size_t j = 0; j < n; ++j) {
+				if (ent[j] & (PM_PRESENT | PM_SWAP)) {
+					memcpy(s->copy + r->data + (p + j) * 4096,
+							(void *)(r->start + (p + j) * 4096), 4096);
+					saved[(p + j) / 8] |= 1 << (p + j) % 8;
+				}
+			}
+		}
+	}
+	close(pm);
+
+	s->tracked = clear_soft_dirty();
+	s->valid = 1;
+	return 0;
+}
+
+static int snap_rollback(struct mc_snap *s) {
+	/* file mappings cannot be brought back, only left as they were */
+	struct snap_check c = { s };
+	if (foreach_map(snap_check_map, &c)) {
+		mc_snap_error("minicriu: cannot read maps\n");
+		return 1;
+	}
+	snap_check_gone(&c, c.last, ~0UL);
+	if (c.changed) {
+		mc_snap_error("minicriu: file or shared mappings changed since the snapshot\n");
+		return 1;
+	}
+
+	/* everything that was mapped after the snapshot */
+	struct mc_unmap *u = &s->unmap;
+	u->maps = s->maps;
+	u->maps_n = s->nmaps;
+	u->files = 1;
+	int err = unmap_new(u);
+	if (err < 0) {
+		mc_snap_error("minicriu: cannot read maps\n");
+		return 1;
+	}
+
+	/* anonymous memory unmapped since is mapped back, the content follows */
+	do {
+		u->n = 0;
+		u->more = 0;
+		u->last = 0;
+		if (foreach_map(find_gone_map, u)) {
+			mc_snap_error("minicriu: cannot read maps\n");
+			return 1;
+		}
+		find_gone_map(~0UL, ~0UL, "", u);
+		for (int i = 0; i < u->n; ++i) {
+			const struct mc_map *m = &u->map[i];
+			if (mmap((void *)m->start, m->end - m->start, m->prot,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+				mc_snap_error("minicriu: cannot map memory back\n");
+				return 1;
+			}
+		}
+	} while (u->more);
+	for (int i = 0; i < s->nmaps; ++i) {
+		const struct mc_map *m = &s->maps[i];
+		mprotect((void *)m->start, m->end - m->start, m->prot);
+	}
+
+	int pm = open("/proc/self/pagemap", O_RDONLY);
+	if (pm < 0) {
+		mc_snap_error("minicriu: cannot open pagemap\n");
+		return 1;
+	}
+	for (int i = 0; i < s->nregions; ++i) {
+		const struct mc_snap_region *r = &s->regions[i];
+		const uint8_t *saved = (uint8_t *)s->copy + r->saved;
+		uint64_t ent[512];
+		size_t npages = (r->end - r->start) / 4096;
+		for (size_t p = 0; p < npages; p += 512) {
+			size_t n = npages - p < 512 ? npages - p : 512;
+			if (pread(pm, ent, n * sizeof(ent[0]), (r->start / 4096 + p) * sizeof(ent[0])) !=
+					n * sizeof(ent[0])) {
+				close(pm);
+				mc_snap_error("minicriu: cannot read pagemap\n");
+				return 1;
+			}
+			for (size_t j = 0; j < n; ++j) {
+				void *page = (void *)(r->start + (p + j) * 4096);
+				const char *copy = s->copy + r->data + (p + j) * 4096;
+				int was = saved[(p + j) / 8] >> (p + j) % 8 & 1;
+				int is = !!(ent[j] & (PM_PRESENT | PM_SWAP));
+				if (!is) {
+					/* dropped since, or as it was */
+					if (was) {
+						memcpy(page, copy, 4096);
+					}
+				} else if (s->tracked && !(ent[j] & PM_SOFT_DIRTY)) {
+					continue;
+				} else if (!was) {
+					/* back to zero, or to the file content */
+					madvise(page, 4096, MADV_DONTNEED);
+				} else if (s->tracked || memcmp(page, copy, 4096)) {
+					memcpy(page, copy, 4096);
+				}
+			}
+		}
+	}
+	close(pm);
+
+	mc_dirty_tracked = 0;
+	s->tracked = clear_soft_dirty();
+	return 0;
+}
+
+/* A checkpoint cleared the soft-dirty bits, rollback has to compare pages. */
+static void mc_snap_untrack(void) {
+	if (mc_snap) {
+		mc_snap->tracked = 0;
+	}
+}
+
+static void snap_save_thread(struct mc_snap_thread *t, const ucontext_t *uc) {
+	t->uc = *uc;
+	t->fpsize = mc_fpsize(uc);
+	if (MC_FPSTATE_MAX < t->fpsize) {
+		mc_snap_error("minicriu: FP state too large\n");
+		return;
+	}
+	memcpy(t->fp, uc->uc_mcontext.fpregs, t->fpsize);
+}
+
+/* Makes the signal return go to where the thread was at snapshot. */
+static void snap_load_thread(const struct mc_snap_thread *t, ucontext_t *uc, int taker) {
+	memcpy(uc->uc_mcontext.gregs, t->uc.uc_mcontext.gregs, sizeof(gregset_t));
+	uc->uc_sigmask = t->uc.uc_sigmask;
+	if (mc_fpsize(uc) == t->fpsize) {
+		memcpy(uc->uc_mcontext.fpregs, t->fp, t->fpsize);
+	}
+	if (taker) {
+		/* the tkill in mc_snap_run() returns 1 */
+		uc->uc_mcontext.gregs[REG_RAX] = 1;
+	}
+}
+
+static void mc_snap_sighnd(ucontext_t *uc) {
+	struct mc_snap *s = mc_snap;
+	pid_t tid = syscall(SYS_gettid);
+	int mode = s->mode;
+
+	struct mc_snap_thread *t = NULL;
+	if (mode == MC_SNAP_TAKE) {
+		int i = __atomic_fetch_add(&s->nsnap, 1, __ATOMIC_SEQ_CST);
+		if (i < MC_SNAP_THREADS) {
+			t = &s->threads[i];
+		} else {
+			mc_snap_error("minicriu: too many threads to snapshot\n");
+		}
+	} else {
+		for (int i = 0; i < s->nsnap; ++i) {
+			if (s->threads[i].tid == tid) {
+				t = &s->threads[i];
+			}
+		}
+		if (!t) {
+			mc_snap_error("minicriu: thread started after snapshot\n");
+		}
+	}
+
+	stack_t ss;
+	sigaltstack(NULL, &ss);
+	if (!(ss.ss_flags & SS_ONSTACK)) {
+		mc_snap_error("minicriu: thread has no altstack, not registered?\n");
+	} else if (t && mode == MC_SNAP_TAKE) {
+		t->tid = tid;
+		t->altstack = (unsigned long)ss.ss_sp;
+		t->altstack_end = (unsigned long)ss.ss_sp + ss.ss_size;
+		snap_save_thread(t, uc);
+	}
+
+	mc_inc_wake(&s->arrived);
+
+	if (tid == s->caller) {
+		mc_wait_for(&s->arrived, s->nthreads);
+		if (mode == MC_SNAP_ROLLBACK && s->nthreads != s->nsnap) {
+			mc_snap_error("minicriu: threads changed since snapshot\n");
+		}
+		if (!s->err) {
+			if (mode == MC_SNAP_TAKE) {
+				snap_take(s);
+			} else {
+				snap_rollback(s);
+			}
+		}
+		s->release = 1;
+		mc_futex(&s->release, FUTEX_WAKE, INT_MAX);
+	} else {
+		mc_wait_for(&s->release, 1);
+	}
+
+	if (mode == MC_SNAP_ROLLBACK && !s->err) {
+		snap_load_thread(t, uc, tid == s->taker);
+	}
+
+	if (tid == s->caller) {
+		/* after a rollback the caller may not be back in mc_snap_run() */
+		mc_wait_for(&s->left, s->nthreads - 1);
+		s->mode = MC_SNAP_IDLE;
+		sigaction(MC_THREAD_SIG, &s->oldhnd, NULL);
+		s->busy = 0;
+		mc_futex(&s->busy, FUTEX_WAKE, INT_MAX);
+	} else {
+		mc_inc_wake(&s->left);
+	}
+}
+
+/* Stops all threads in mc_snap_sighnd() and has the caller do mode. */
+static long mc_snap_run(int mode) {
+	struct mc_snap *s = mc_snap;
+	pid_t mytid = syscall(SYS_gettid);
+
+	while (__atomic_exchange_n(&s->busy, 1, __ATOMIC_SEQ_CST)) {
+		mc_futex(&s->busy, FUTEX_WAIT, 1);
+	}
+
+	struct sigaction newhnd = {
+		.sa_sigaction = mc_sighnd,
+		.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART,
+	};
+	if (sigaction(MC_THREAD_SIG, &newhnd, &s->oldhnd)) {
+		perror("sigaction");
+		s->busy = 0;
+		mc_futex(&s->busy, FUTEX_WAKE, INT_MAX);
+		return -1;
+	}
+
+	s->caller = mytid;
+	s->err = 0;
+	s->arrived = s->release = s->left = 0;
+	if (mode == MC_SNAP_TAKE) {
+		s->valid = 0;
+		s->taker = mytid;
+		s->nsnap = 0;
+	}
+	s->nthreads = 1;
+	s->mode = mode;
+
+	DIR* tasksdir = opendir("/proc/self/task/");
+	struct dirent *taskdent;
+	while (tasksdir && (taskdent = readdir(tasksdir))) {
+		int tid = atoi(taskdent->d_name);
+		if (taskdent->d_name[0] == '.' || tid == mytid) {
+			continue;
+		}
+		if (!syscall(SYS_tkill, tid, MC_THREAD_SIG)) {
+			++s->nthreads;
+		}
+	}
+	if (tasksdir) {
+		closedir(tasksdir);
+	}
+
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, MC_THREAD_SIG);
+	pthread_sigmask(SIG_UNBLOCK, &set, &old);
+	long r = syscall(SYS_tkill, mytid, MC_THREAD_SIG);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return r;
+}
+
+static int mc_snap_init(void) {
+	if (mc_altstack()) {
+		return 1;
+	}
+	if (mc_snap) {
+		return 0;
+	}
+	void *p = mmap(NULL, align_up(sizeof(*mc_snap), 4096), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap snapshot");
+		return 1;
+	}
+	mc_snap = p;
+	return 0;
+}
+
+int minicriu_snapshot(void) {
+	if (mc_snap_init()) {
+		return -1;
+	}
+	long r = mc_snap_run(MC_SNAP_TAKE);
+	if (r == 1) {
+		return 1;
+	}
+	return r || mc_snap->err ? -1 : 0;
+}
+
+int minicriu_rollback(void) {
+	if (!mc_snap || !mc_snap->valid) {
+		fprintf(stderr, "minicriu: no snapshot to roll back to\n");
+		return -1;
+	}
+	if (mc_snap_init()) {
+		return -1;
+	}
+	mc_snap_run(MC_SNAP_ROLLBACK);
+	/* back only if it failed */
+	return -1;
+}
+
+static void mc_sighnd(int sig, siginfo_t *info, void *uc) {
+
+	if (mc_snap && mc_snap->mode) {
+		mc_snap_sighnd(uc);
+		return;
+	}
+
+	save_thread_placement();
 
 	__atomic_fetch_add(&mc_futex_checkpoint, 1, __ATOMIC_SEQ_CST);
 	syscall(SYS_futex, &mc_futex_checkpoint, FUTEX_WAKE, 1);
@@ -290,12 +1422,23 @@ static void mc_sighnd(int sig) {
 	int newtid = syscall(SYS_gettid);
 	*gettid_ptr(pthread_self()) = newtid;
 
+	__atomic_fetch_add(&mc_futex_resumed, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &mc_futex_resumed, FUTEX_WAKE, 1);
+
+	while (!mc_futex_released) {
+		syscall(SYS_futex, &mc_futex_released, FUTEX_WAIT, 0);
+	}
+
 	volatile int thread_loop = 0;
 	while (thread_loop);
 }
 
 int minicriu_register_new_thread(void) {
 
+	if (mc_altstack()) {
+		return 1;
+	}
+
 	sigset_t set;
 	sigemptyset(&set);
 	sigaddset(&set, MC_THREAD_SIG);
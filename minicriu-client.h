@@ -34,6 +34,35 @@ extern int minicriu_register_new_thread(void);
 
 extern int minicriu_dump(void);
 
+struct minicriu_estimate {
+	unsigned long image_size;	/* bytes */
+	int threads;			/* to be stopped by minicriu_dump() */
+	unsigned long dirty_pages;	/* written since the last checkpoint */
+	unsigned long dump_time_us;
+};
+
+/*
+ * Projects the cost of minicriu_dump() without stopping any thread.
+ * Cheap enough to be called every few seconds. After minicriu_snapshot()
+ * or minicriu_rollback(), which reset the same soft-dirty tracking,
+ * dirty_pages counts all resident pages until the next checkpoint.
+ */
+extern int minicriu_estimate(struct minicriu_estimate *est);
+
+/*
+ * Saves registers of all threads and private writable memory, in memory.
+ * Returns 0 once saved, and 1 when minicriu_rollback() comes back here.
+ * All threads but the calling one must be registered.
+ */
+extern int minicriu_snapshot(void);
+
+/*
+ * Returns all threads to where they were at minicriu_snapshot(), copying
+ * back only the pages written since. Does not return unless it fails.
+ * The set of threads must not change in between.
+ */
+extern int minicriu_rollback(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
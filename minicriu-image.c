@@ -0,0 +1,424 @@
+/*
+ * Copyright 2017-2022 Azul Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/auxvec.h>
+#include <cpuid.h>
+
+#include "minicriu-image.h"
+
+int img_fd;
+int img_stream;
+static off_t img_pos;
+/* of a seekable image */
+static off_t img_size;
+
+static char img_scratch[64 * 1024];
+
+int img_open(const char *path) {
+	if (!strcmp(path, "-")) {
+		img_fd = STDIN_FILENO;
+	} else {
+		img_fd = open(path, O_RDONLY);
+		if (img_fd < 0) {
+			perror("open");
+			return -1;
+		}
+	}
+
+	struct stat st;
+	if (fstat(img_fd, &st)) {
+		perror("stat");
+		return -1;
+	}
+	img_stream = !S_ISREG(st.st_mode);
+	img_size = st.st_size;
+	return 0;
+}
+
+static ssize_t img_read1(void *buf, size_t len, off_t off) {
+	ssize_t r;
+	do {
+		r = img_stream ? read(img_fd, buf, len) : pread(img_fd, buf, len, off);
+	} while (r < 0 && errno == EINTR);
+	if (0 < r && img_stream) {
+		img_pos += r;
+	}
+	return r;
+}
+
+/*
+ * Reads len bytes at off of the image. A non-seekable image (pipe, stdin)
+ * is consumed strictly in file order: data up to off is skipped, and
+ * going back is an error.
+ */
+int img_read(void *buf, size_t len, off_t off) {
+	return img_read_crc(buf, len, off, NULL);
+}
+
+int img_read_crc(void *buf, size_t len, off_t off, uint32_t *crc) {
+	ssize_t r;
+	if (img_stream) {
+		if (off < img_pos) {
+			fprintf(stderr, "image offset %lx is behind stream position %lx\n", off, img_pos);
+			return -1;
+		}
+		while (img_pos < off) {
+			size_t n = off - img_pos;
+			r = img_read1(img_scratch, n < sizeof(img_scratch) ? n : sizeof(img_scratch), img_pos);
+			if (r <= 0) {
+				goto fail;
+			}
+		}
+	}
+
+	char *p = buf;
+	while (len) {
+		const char *data = p;
+		r = img_read1(p, len, off);
+		if (r < 0 && errno == EFAULT) {
+			/*
+			 * The target page is not backed, e.g. a file mapping beyond
+			 * the end of file. The original process could not access
+			 * it either, so its content is dropped.
+			 */
+			size_t n = 4096 - ((uintptr_t)p & 4095);
+			r = img_read1(img_scratch, n < len ? n : len, off);
+			data = img_scratch;
+		}
+		if (r <= 0) {
+			goto fail;
+		}
+		if (crc) {
+			*crc = crc32c(*crc, data, r);
+		}
+		p += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+
+fail:
+	if (r < 0) {
+		perror("read image");
+	} else {
+		fprintf(stderr, "image truncated at offset %lx\n", off);
+	}
+	return -1;
+}
+
+int img_read_headers(Elf64_Ehdr *ehdr, Elf64_Phdr **phdrs) {
+	if (img_read(ehdr, sizeof(*ehdr), 0)) {
+		return -1;
+	}
+	if (strncmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
+		fprintf(stderr, "ELF header mismatch\n");
+		return -1;
+	}
+
+	if (!ehdr->e_phoff ||
+			!ehdr->e_phnum ||
+			ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
+		fprintf(stderr, "bad ehdr\n");
+		return -1;
+	}
+	*phdrs = malloc(ehdr->e_phnum * sizeof(Elf64_Phdr));
+	if (!*phdrs) {
+		perror("malloc phdrs");
+		return -1;
+	}
+	return img_read(*phdrs, ehdr->e_phnum * sizeof(Elf64_Phdr), ehdr->e_phoff);
+}
+
+const Elf64_Phdr *img_find_phdr(const Elf64_Phdr *phdrs, int phnum, unsigned type) {
+	for (int i = 0; i < phnum; ++i) {
+		if (phdrs[i].p_type == type) {
+			return phdrs + i;
+		}
+	}
+	return NULL;
+}
+
+void *img_read_notes(const Elf64_Phdr *ph_notes, size_t *size) {
+	*size = align_up(ph_notes->p_filesz, 4096);
+	void *notes = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (notes == MAP_FAILED) {
+		perror("mmap notes");
+		return NULL;
+	}
+	if (img_read(notes, ph_notes->p_filesz, ph_notes->p_offset)) {
+		munmap(notes, *size);
+		return NULL;
+	}
+	return notes;
+}
+
+int img_next_note(void *notes, size_t size, size_t *off, struct img_note *n) {
+	if (size < *off + sizeof(Elf64_Nhdr)) {
+		return 0;
+	}
+	n->nh = notes + *off;
+	size_t nameoff = *off + sizeof(*n->nh);
+	size_t doff = nameoff + align_up(n->nh->n_namesz, 4);
+	*off = doff + align_up(n->nh->n_descsz, 4);
+	if (size < *off) {
+		return 0;
+	}
+	n->name = notes + nameoff;
+	n->desc = notes + doff;
+	return 1;
+}
+
+unsigned long img_auxv(const struct img_note *auxv, unsigned long type) {
+	const unsigned long *av = auxv->desc;
+	for (int i = 0; i + 1 < auxv->nh->n_descsz / sizeof(long) && av[i] != AT_NULL; i += 2) {
+		if (av[i] == type) {
+			return av[i + 1];
+		}
+	}
+	return 0;
+}
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc;
+	for (; len && ((uintptr_t)p & 7); --len) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+	}
+	for (; 8 <= len; len -= 8, p += 8) {
+		c = __builtin_ia32_crc32di(c, *(const uint64_t *)p);
+	}
+	for (; len; --len) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+	}
+	return c;
+}
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* once, as the seal workers start hashing all at the same time */
+static void crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = c & 1 ? c >> 1 ^ 0x82f63b78 : c >> 1;
+		}
+		crc32c_table[i] = c;
+	}
+	unsigned eax, ebx, ecx, edx;
+	crc32c_hw = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	if (crc32c_hw) {
+		return ~crc32c_sse42(~crc, buf, len);
+	}
+	const unsigned char *p = buf;
+	crc = ~crc;
+	while (len--) {
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ crc >> 8;
+	}
+	return ~crc;
+}
+
+int img_csum_blocks(const Elf64_Phdr *phdrs, int phnum, uint32_t *base) {
+	uint32_t n = 0;
+	for (int i = 0; i < phnum; ++i) {
+		if (base) {
+			base[i] = n;
+		}
+		if (phdrs[i].p_type == PT_LOAD) {
+			n += (phdrs[i].p_filesz + IMG_CSUM_BLOCK - 1) / IMG_CSUM_BLOCK;
+		}
+	}
+	return n;
+}
+
+int img_csum_parse(const struct img_csum_trailer *tr, const uint32_t *table, uint32_t nblocks) {
+	if (tr->magic != IMG_CSUM_MAGIC) {
+		return 1;
+	}
+	if (tr->crc != crc32c(0, tr, offsetof(struct img_csum_trailer, crc)) ||
+			tr->block != IMG_CSUM_BLOCK || tr->nblocks != nblocks ||
+			(table && tr->table_crc != crc32c(0, table, nblocks * sizeof(*table)))) {
+		fprintf(stderr, "image checksums are damaged\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* the expected block checksums, or NULL if the image is not sealed */
+static uint32_t *csum_table;
+static uint32_t *csum_base;
+/* computed in stream mode, where the table comes last */
+static uint32_t *csum_seen;
+static uint8_t *csum_have;
+static uint32_t csum_n;
+static const Elf64_Phdr *csum_phdrs;
+static int csum_phnum;
+
+int img_csum_open(const Elf64_Phdr *phdrs, int phnum) {
+	csum_phdrs = phdrs;
+	csum_phnum = phnum;
+	csum_base = malloc(phnum * sizeof(*csum_base));
+	if (!csum_base) {
+		perror("malloc checksums");
+		return -1;
+	}
+	csum_n = img_csum_blocks(phdrs, phnum, csum_base);
+
+	if (img_stream) {
+		/* sealed or not is not known yet, so hash everything */
+		csum_seen = calloc(csum_n + 1, sizeof(*csum_seen));
+		csum_have = calloc(csum_n + 1, 1);
+		if (!csum_seen || !csum_have) {
+			perror("malloc checksums");
+			return -1;
+		}
+		return 0;
+	}
+
+	struct img_csum_trailer tr;
+	size_t tabsz = csum_n * sizeof(*csum_table);
+	if (img_size < sizeof(tr) ||
+			img_read(&tr, sizeof(tr), img_size - sizeof(tr)) ||
+			tr.magic != IMG_CSUM_MAGIC) {
+		/* not sealed */
+		return 0;
+	}
+	if (img_size != tr.size + tabsz + sizeof(tr)) {
+		fprintf(stderr, "image checksums do not match the image size\n");
+		return -1;
+	}
+	csum_table = malloc(tabsz + 1);
+	if (!csum_table) {
+		perror("malloc checksums");
+		return -1;
+	}
+	if (img_read(csum_table, tabsz, tr.size) || img_csum_parse(&tr, csum_table, csum_n)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void csum_report(int phdr, size_t block) {
+	const Elf64_Phdr *ph = csum_phdrs + phdr;
+	unsigned long off = block * IMG_CSUM_BLOCK;
+	fprintf(stderr, "checksum mismatch in segment %d vaddr %llx-%llx, bytes %lx-%lx at file offset %llx\n",
+			phdr, ph->p_vaddr, ph->p_vaddr + ph->p_memsz,
+			off, off + IMG_CSUM_BLOCK < ph->p_filesz ? off + IMG_CSUM_BLOCK : (unsigned long)ph->p_filesz,
+			ph->p_offset + off);
+}
+
+int img_csum_check(int phdr, size_t block, uint32_t crc) {
+	uint32_t i = csum_base[phdr] + block;
+	if (csum_seen) {
+		csum_seen[i] = crc;
+		csum_have[i] = 1;
+		return 0;
+	}
+	if (csum_table && csum_table[i] != crc) {
+		csum_report(phdr, block);
+		return -1;
+	}
+	return 0;
+}
+
+int img_csum_wanted(void) {
+	return csum_table || csum_seen;
+}
+
+int img_csum_close(void) {
+	int ret = 0;
+	if (csum_seen) {
+		/* the table and the trailer are what is left of the stream */
+		size_t need = sizeof(struct img_csum_trailer) + csum_n * sizeof(uint32_t);
+		size_t len = 0, cap = 2 * need;
+		char *rest = malloc(cap);
+		ssize_t r = 0;
+		while (rest && (r = img_read1(rest + len, cap - len, img_pos)) > 0) {
+			len += r;
+			if (len == cap) {
+				/* more than a table, keep only the end */
+				memmove(rest, rest + cap - need, need);
+				len = need;
+			}
+		}
+		if (!rest || r < 0) {
+			perror("read image");
+			ret = -1;
+		} else if (sizeof(struct img_csum_trailer) <= len) {
+			struct img_csum_trailer tr;
+			memcpy(&tr, rest + len - sizeof(tr), sizeof(tr));
+			if (tr.magic != IMG_CSUM_MAGIC) {
+				/* not sealed */
+			} else if (len < need) {
+				fprintf(stderr, "image checksums are damaged\n");
+				ret = -1;
+			} else if (img_csum_parse(&tr, (uint32_t *)(rest + len - need), csum_n)) {
+				ret = -1;
+			} else {
+				const uint32_t *table = (uint32_t *)(rest + len - need);
+				for (int p = 0; p < csum_phnum && !ret; ++p) {
+					uint32_t n = img_csum_blocks(csum_phdrs + p, 1, NULL);
+					for (uint32_t b = 0; b < n; ++b) {
+						uint32_t i = csum_base[p] + b;
+						if (csum_have[i] && csum_seen[i] != table[i]) {
+							csum_report(p, b);
+							ret = -1;
+							break;
+						}
+					}
+				}
+			}
+		}
+		free(rest);
+	}
+	free(csum_seen);
+	free(csum_have);
+	free(csum_table);
+	free(csum_base);
+	csum_seen = csum_table = csum_base = NULL;
+	csum_have = NULL;
+	return ret;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017-2022 Azul Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/*
+ * Reading of core images, shared by the restorer and the tools.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/elf.h>
+
+extern int img_fd;
+/* the image is a pipe or alike and can be only read front to back */
+extern int img_stream;
+
+/* NT_FILE descriptor, followed by count file names */
+struct img_nt_file {
+	long count;
+	long page_size;
+	struct img_filemap {
+		long start;
+		long end;
+		long file_ofs;
+	} map[0];
+};
+
+struct img_note {
+	const Elf64_Nhdr *nh;
+	const char *name;
+	void *desc;
+};
+
+/*
+ * minicriu-seal appends CRC32C of each IMG_CSUM_BLOCK of PT_LOAD contents,
+ * in phdr order, and then the trailer, at the very end of the image.
+ */
+#define IMG_CSUM_MAGIC 0x31306d7573636d63UL	/* "mccsum01" */
+#define IMG_CSUM_BLOCK (1 << 20)
+
+struct img_csum_trailer {
+	uint64_t magic;
+	uint64_t size;		/* of the image before sealing */
+	uint32_t block;
+	uint32_t nblocks;
+	uint32_t table_crc;
+	uint32_t crc;		/* of the trailer up to here */
+};
+
+static inline unsigned long align_up(unsigned long v, unsigned p) {
+	return (v + p - 1) & ~(p - 1);
+}
+
+/* Opens the image at path, or stdin for "-". */
+extern int img_open(const char *path);
+
+extern int img_read(void *buf, size_t len, off_t off);
+
+/* Reads as img_read(), and also adds what was read to *crc. */
+extern int img_read_crc(void *buf, size_t len, off_t off, uint32_t *crc);
+
+/* Reads and checks the ELF header, and reads the malloc()ed phdrs. */
+extern int img_read_headers(Elf64_Ehdr *ehdr, Elf64_Phdr **phdrs);
+
+extern const Elf64_Phdr *img_find_phdr(const Elf64_Phdr *phdrs, int phnum, unsigned type);
+
+/* Reads the notes into a fresh mapping of *size bytes. */
+extern void *img_read_notes(const Elf64_Phdr *ph_notes, size_t *size);
+
+/* Fills n with the note at *off of notes and advances *off past it. */
+extern int img_next_note(void *notes, size_t size, size_t *off, struct img_note *n);
+
+/* Looks type up in NT_AUXV, 0 if not there. */
+extern unsigned long img_auxv(const struct img_note *auxv, unsigned long type);
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Counts checksum blocks, and fills base with the first block of each phdr. */
+extern int img_csum_blocks(const Elf64_Phdr *phdrs, int phnum, uint32_t *base);
+
+/* Returns 0 for a good trailer, 1 for none, -1 for a damaged one. */
+extern int img_csum_parse(const struct img_csum_trailer *tr, const uint32_t *table, uint32_t nblocks);
+
+/*
+ * Verification of populated blocks. img_csum_check() reports a mismatch
+ * right away, except for a streamed image, whose checksums come only
+ * with its end, read by img_csum_close(). Unsealed images pass.
+ */
+extern int img_csum_open(const Elf64_Phdr *phdrs, int phnum);
+extern int img_csum_check(int phdr, size_t block, uint32_t crc);
+/*
+ * Tells if blocks need hashing at all: the image is sealed, or streamed.
+ * Whether a stream is sealed shows only at its end, so it is hashed as it
+ * is read in case it is, and an unsealed one pays for that.
+ */
+extern int img_csum_wanted(void);
+extern int img_csum_close(void);
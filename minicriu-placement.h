@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017-2022 Azul Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/*
+ * Where the threads and memory of a process were placed at checkpoint.
+ * The client library fills it in before the core is dumped and passes its
+ * address in r8 of the kill syscall, so the restorer can find it in the
+ * image and put the process back on the same CPUs and NUMA nodes.
+ */
+
+#include <sched.h>
+#include <sys/types.h>
+
+#define MC_PLACEMENT_MAGIC 0x6d63706c61636532UL
+
+#define MC_PLACEMENT_THREADS 128
+#define MC_PLACEMENT_REGIONS 1024
+#define MC_MAX_NODES 1024
+
+struct mc_thread_placement {
+	pid_t tid;
+	int policy;	/* sched_getscheduler() */
+	int priority;
+	int nice;	/* getpriority(), for SCHED_OTHER and SCHED_BATCH */
+	int mempolicy;	/* get_mempolicy() mode and flags, -1 if unknown */
+	unsigned long nodes[MC_MAX_NODES / (8 * sizeof(long))];
+	cpu_set_t affinity;
+};
+
+struct mc_region_placement {
+	unsigned long start, end;
+	int mempolicy;	/* get_mempolicy() mode and flags, -1 if unknown */
+	int node;	/* where most of the resident pages are, -1 if none */
+	unsigned long nodes[MC_MAX_NODES / (8 * sizeof(long))];
+};
+
+struct mc_placement {
+	unsigned long magic;
+	int nthreads;
+	int nregions;
+	struct mc_thread_placement threads[MC_PLACEMENT_THREADS];
+	struct mc_region_placement regions[MC_PLACEMENT_REGIONS];
+};
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2017-2022 Azul Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Appends block checksums of PT_LOAD contents to a core, for the restorer
+ * to verify while it populates memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "minicriu-image.h"
+
+struct block {
+	const char *p;
+	size_t len;
+};
+
+static const char *img;
+static struct block *blocks;
+static uint32_t *table;
+static uint32_t nblocks;
+/* hashing blocks, each takes its share of them */
+static long nworkers;
+
+static void *seal_worker(void *arg) {
+	long t = (long)arg;
+	long n = nworkers;
+	for (size_t i = nblocks * t / n; i < nblocks * (t + 1) / n; ++i) {
+		table[i] = crc32c(0, blocks[i].p, blocks[i].len);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <core>\n", argv[0]);
+		return 1;
+	}
+	const char *path = argv[1];
+
+	if (img_open(path)) {
+		return 1;
+	}
+	if (img_stream) {
+		fprintf(stderr, "%s is not a regular file\n", path);
+		return 1;
+	}
+
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr *phdrs;
+	if (img_read_headers(&ehdr, &phdrs)) {
+		return 1;
+	}
+
+	off_t size = lseek(img_fd, 0, SEEK_END);
+	struct img_csum_trailer tr;
+	if (sizeof(tr) <= size && !img_read(&tr, sizeof(tr), size - sizeof(tr)) &&
+			tr.magic == IMG_CSUM_MAGIC) {
+		fprintf(stderr, "%s is already sealed\n", path);
+		return 0;
+	}
+
+	nblocks = img_csum_blocks(phdrs, ehdr.e_phnum, NULL);
+	blocks = malloc((nblocks + 1) * sizeof(*blocks));
+	table = malloc((nblocks + 1) * sizeof(*table));
+	if (!blocks || !table) {
+		perror("malloc");
+		return 1;
+	}
+
+	img = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, img_fd, 0) : NULL;
+	if (img == MAP_FAILED) {
+		perror("mmap image");
+		return 1;
+	}
+	madvise((void *)img, size, MADV_SEQUENTIAL);
+
+	uint32_t n = 0;
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		if (size < ph->p_offset + ph->p_filesz) {
+			fprintf(stderr, "image truncated at offset %lx\n", size);
+			return 1;
+		}
+		for (size_t done = 0; done < ph->p_filesz; done += IMG_CSUM_BLOCK) {
+			size_t len = ph->p_filesz - done;
+			blocks[n++] = (struct block) {
+				img + ph->p_offset + done,
+				len < IMG_CSUM_BLOCK ? len : IMG_CSUM_BLOCK,
+			};
+		}
+	}
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t workers[nworkers];
+	for (long t = 0; t < nworkers; ++t) {
+		if (pthread_create(&workers[t], NULL, seal_worker, (void *)t)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (long t = 0; t < nworkers; ++t) {
+		pthread_join(workers[t], NULL);
+	}
+
+	tr = (struct img_csum_trailer) {
+		.magic = IMG_CSUM_MAGIC,
+		.size = size,
+		.block = IMG_CSUM_BLOCK,
+		.nblocks = nblocks,
+		.table_crc = crc32c(0, table, nblocks * sizeof(*table)),
+	};
+	tr.crc = crc32c(0, &tr, offsetof(struct img_csum_trailer, crc));
+
+	int fd = open(path, O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (write(fd, table, nblocks * sizeof(*table)) != nblocks * sizeof(*table) ||
+			write(fd, &tr, sizeof(tr)) != sizeof(tr) ||
+			fsync(fd)) {
+		perror("write checksums");
+		ftruncate(fd, size);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
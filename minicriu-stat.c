@@ -0,0 +1,475 @@
+/*
+ * Copyright 2017-2022 Azul Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reports what is in an image: region classes, zero and duplicate pages,
+ * compressibility, and the amount of I/O a restore would do.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+#include <sys/procfs.h>
+#include <linux/auxvec.h>
+
+#include "minicriu-image.h"
+
+#define PAGE 4096
+#define VSYSCALL_ADDR 0xffffffffff600000UL
+#define HEAP_MAX_GAP (1UL << 30)
+
+enum cls { C_HEAP, C_STACK, C_FILE, C_ANON, C_VDSO, C_NUM };
+
+static const char *cls_name[C_NUM] = {
+	[C_HEAP] = "heap",
+	[C_STACK] = "stack",
+	[C_FILE] = "file",
+	[C_ANON] = "anon",
+	[C_VDSO] = "vdso",
+};
+
+struct stat_cls {
+	unsigned long regions;
+	unsigned long size;
+	unsigned long filesz;
+	unsigned long pages;
+	unsigned long zero;
+	unsigned long dup;
+	double compressed;
+};
+
+struct page {
+	const uint64_t *p;
+	uint64_t hash;
+	float compressed;
+	uint8_t cls;
+	uint8_t zero;
+};
+
+static struct page *pages;
+static size_t npages;
+/* scanning pages, each takes its share of them */
+static long nworkers;
+
+/* c * log2(c), so a page entropy is a sum of table lookups */
+static float clog2c[PAGE + 1];
+
+static int nthreads;
+static unsigned long sp[128];
+static unsigned long vdso_addr, phdr_addr;
+static struct img_nt_file *nt_file;
+
+static unsigned long exe_end(void) {
+	if (!nt_file) {
+		return 0;
+	}
+	const char *names = (const char *)&nt_file->map[nt_file->count];
+	const char *exe = NULL;
+	const char *name = names;
+	for (int i = 0; i < nt_file->count; ++i, name += strlen(name) + 1) {
+		if (nt_file->map[i].start <= phdr_addr && phdr_addr < nt_file->map[i].end) {
+			exe = name;
+		}
+	}
+	unsigned long end = 0;
+	name = names;
+	for (int i = 0; exe && i < nt_file->count; ++i, name += strlen(name) + 1) {
+		if (!strcmp(name, exe) && end < nt_file->map[i].end) {
+			end = nt_file->map[i].end;
+		}
+	}
+	return end;
+}
+
+static int file_backed(unsigned long start, unsigned long end) {
+	for (int i = 0; nt_file && i < nt_file->count; ++i) {
+		if (nt_file->map[i].start < end && start < nt_file->map[i].end) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void classify(const Elf64_Phdr *phdrs, int phnum, enum cls *cls) {
+	unsigned long exe = exe_end();
+	int heap = 0;
+	for (int i = 0; i < phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		unsigned long start = ph->p_vaddr, end = ph->p_vaddr + ph->p_memsz;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		cls[i] = C_ANON;
+		if ((start <= vdso_addr && vdso_addr < end) || start == VSYSCALL_ADDR) {
+			cls[i] = C_VDSO;
+			continue;
+		}
+		for (int t = 0; t < nthreads; ++t) {
+			if (start <= sp[t] && sp[t] < end) {
+				cls[i] = C_STACK;
+			}
+		}
+		if (cls[i] == C_STACK) {
+			continue;
+		}
+		if (file_backed(start, end)) {
+			cls[i] = C_FILE;
+			continue;
+		}
+		/* brk starts past .bss, which sits right at the end of the executable */
+		if (!heap && exe < start && start - exe < HEAP_MAX_GAP) {
+			cls[i] = C_HEAP;
+			heap = 1;
+		}
+	}
+
+	/* vvar is right below vdso, read-only unlike memory that may follow */
+	for (unsigned long low = vdso_addr; low; ) {
+		unsigned long next = 0;
+		for (int i = 0; i < phnum; ++i) {
+			const Elf64_Phdr *ph = phdrs + i;
+			if (ph->p_type == PT_LOAD && ph->p_vaddr + ph->p_memsz == low &&
+					cls[i] == C_ANON && !(ph->p_flags & PF_W)) {
+				cls[i] = C_VDSO;
+				next = ph->p_vaddr;
+			}
+		}
+		low = next;
+	}
+}
+
+#define HASH_LANES 16
+
+/*
+ * Zero test and hash of a page, in 32-bit lanes so that both vectorize,
+ * with AVX2 where the CPU has it. Equal hashes are compared in full.
+ */
+__attribute__((target_clones("avx2", "default")))
+static uint64_t page_hash(const uint32_t *w, int *zero) {
+	uint32_t h[HASH_LANES], or[HASH_LANES];
+	for (int j = 0; j < HASH_LANES; ++j) {
+		h[j] = j + 1;
+		or[j] = 0;
+	}
+	for (int i = 0; i < PAGE / 4; i += HASH_LANES) {
+		for (int j = 0; j < HASH_LANES; ++j) {
+			or[j] |= w[i + j];
+			h[j] = (h[j] ^ w[i + j]) * 0x9e3779b1U;
+		}
+	}
+	uint64_t hash = 0;
+	uint32_t any = 0;
+	for (int j = 0; j < HASH_LANES; ++j) {
+		hash = (hash ^ h[j]) * 0x9e3779b97f4a7c15UL;
+		any |= or[j];
+	}
+	*zero = !any;
+	return hash;
+}
+
+static void scan_page(struct page *pg) {
+	const uint64_t *w = pg->p;
+	int zero;
+	pg->hash = page_hash((const uint32_t *)w, &zero);
+	pg->zero = zero;
+	if (pg->zero) {
+		pg->compressed = 0;
+		return;
+	}
+
+	/* order-0 entropy of the page bytes; a byte histogram stays scalar */
+	uint16_t hist[4][256] = { 0 };
+	const uint8_t *b = (const uint8_t *)w;
+	for (int i = 0; i < PAGE; i += 4) {
+		hist[0][b[i]]++;
+		hist[1][b[i + 1]]++;
+		hist[2][b[i + 2]]++;
+		hist[3][b[i + 3]]++;
+	}
+	float sum = 0;
+	for (int c = 0; c < 256; ++c) {
+		sum += clog2c[hist[0][c] + hist[1][c] + hist[2][c] + hist[3][c]];
+	}
+	pg->compressed = (clog2c[PAGE] - sum) / 8;
+}
+
+static void *scan_worker(void *arg) {
+	long t = (long)arg;
+	long n = nworkers;
+	for (size_t i = npages * t / n; i < npages * (t + 1) / n; ++i) {
+		scan_page(&pages[i]);
+	}
+	return NULL;
+}
+
+static int page_cmp(const void *a, const void *b) {
+	const struct page *pa = a, *pb = b;
+	if (pa->hash != pb->hash) {
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	return pa->p < pb->p ? -1 : pa->p > pb->p;
+}
+
+static void print_size(const char *fmt, double v) {
+	const char *unit[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	int u = 0;
+	while (1024 <= v && u < 4) {
+		v /= 1024;
+		++u;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), u ? "%.1f %s" : "%.0f %s", v, unit[u]);
+	printf(fmt, buf);
+}
+
+static double pct(unsigned long a, unsigned long b) {
+	return b ? 100.0 * a / b : 0;
+}
+
+static void print_human(const char *path, const struct stat_cls *st,
+		unsigned long notesz, unsigned long io) {
+	printf("image %s: %d threads\n", path, nthreads);
+	print_size("restore I/O %s", io);
+	print_size(" (notes %s)\n\n", notesz);
+	printf("%-6s %7s %11s %11s %7s %7s %11s\n",
+			"class", "regions", "size", "in image", "zero", "dup", "compressed");
+	for (int c = 0; c <= C_NUM; ++c) {
+		const struct stat_cls *s = st + c;
+		printf("%-6s %7lu", c < C_NUM ? cls_name[c] : "total", s->regions);
+		print_size(" %11s", s->size);
+		print_size(" %11s", s->filesz);
+		printf(" %6.1f%% %6.1f%%", pct(s->zero, s->pages), pct(s->dup, s->pages));
+		print_size(" %11s\n", s->compressed);
+	}
+}
+
+/* Prints s as a JSON string. */
+static void print_json_str(const char *s) {
+	putchar('"');
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+static void print_json(const char *path, const struct stat_cls *st,
+		unsigned long notesz, unsigned long io) {
+	printf("{\"image\": ");
+	print_json_str(path);
+	printf(", \"threads\": %d, \"restore_io\": %lu, \"notes\": %lu, \"classes\": {",
+			nthreads, io, notesz);
+	for (int c = 0; c <= C_NUM; ++c) {
+		const struct stat_cls *s = st + c;
+		printf("%s\"%s\": {\"regions\": %lu, \"size\": %lu, \"filesz\": %lu, "
+				"\"pages\": %lu, \"zero_pages\": %lu, \"dup_pages\": %lu, "
+				"\"compressed\": %.0f}",
+				c ? ", " : "", c < C_NUM ? cls_name[c] : "total",
+				s->regions, s->size, s->filesz, s->pages, s->zero, s->dup, s->compressed);
+	}
+	printf("}}\n");
+}
+
+int main(int argc, char *argv[]) {
+	int json = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j': json = 1; break;
+		default: optind = argc; break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-j] <core>\n"
+				"  -j  print JSON\n",
+				argv[0]);
+		return 1;
+	}
+	const char *path = argv[optind];
+
+	if (img_open(path)) {
+		return 1;
+	}
+	if (img_stream) {
+		fprintf(stderr, "%s is not a regular file\n", path);
+		return 1;
+	}
+
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr *phdrs;
+	if (img_read_headers(&ehdr, &phdrs)) {
+		return 1;
+	}
+	const Elf64_Phdr *ph_notes = img_find_phdr(phdrs, ehdr.e_phnum, PT_NOTE);
+	if (!ph_notes) {
+		fprintf(stderr, "cannot find PT_NOTE\n");
+		return 1;
+	}
+	size_t notesz;
+	void *notes = img_read_notes(ph_notes, &notesz);
+	if (!notes) {
+		return 1;
+	}
+
+	size_t noff = 0;
+	struct img_note n;
+	while (img_next_note(notes, ph_notes->p_filesz, &noff, &n)) {
+		if (strcmp("CORE", n.name)) {
+			continue;
+		}
+		switch (n.nh->n_type) {
+		case NT_PRSTATUS:
+			if (nthreads < sizeof(sp) / sizeof(sp[0])) {
+				struct elf_prstatus *prs = n.desc;
+				sp[nthreads] = ((struct user_regs_struct *)&prs->pr_reg)->rsp;
+			}
+			++nthreads;
+			break;
+		case NT_AUXV:
+			vdso_addr = img_auxv(&n, AT_SYSINFO_EHDR);
+			phdr_addr = img_auxv(&n, AT_PHDR);
+			break;
+		case NT_FILE: nt_file = n.desc; break;
+		default: break;
+		}
+	}
+
+	off_t size = lseek(img_fd, 0, SEEK_END);
+	const char *img = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, img_fd, 0) : NULL;
+	if (img == MAP_FAILED) {
+		perror("mmap image");
+		return 1;
+	}
+	madvise((void *)img, size, MADV_SEQUENTIAL);
+
+	enum cls *cls = calloc(ehdr.e_phnum, sizeof(*cls));
+	struct stat_cls st[C_NUM + 1] = { 0 };
+	classify(phdrs, ehdr.e_phnum, cls);
+
+	unsigned long io = ph_notes->p_filesz;
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		if (size < ph->p_offset + ph->p_filesz) {
+			fprintf(stderr, "image truncated at offset %llx\n", ph->p_offset + ph->p_filesz);
+			return 1;
+		}
+		struct stat_cls *s = st + cls[i];
+		s->regions++;
+		s->size += ph->p_memsz;
+		s->filesz += ph->p_filesz;
+		/* the tail of a segment not filling a page is taken as incompressible */
+		s->compressed += ph->p_filesz % PAGE;
+		npages += ph->p_filesz / PAGE;
+		io += ph->p_filesz;
+	}
+
+	pages = malloc(npages * sizeof(*pages));
+	if (npages && !pages) {
+		perror("malloc pages");
+		return 1;
+	}
+	size_t np = 0;
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		for (unsigned long off = 0; off + PAGE <= ph->p_filesz; off += PAGE) {
+			pages[np].p = (const uint64_t *)(img + ph->p_offset + off);
+			pages[np].cls = cls[i];
+			++np;
+		}
+	}
+
+	for (int c = 1; c <= PAGE; ++c) {
+		clog2c[c] = c * log2f(c);
+	}
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t workers[nworkers];
+	for (long t = 0; t < nworkers; ++t) {
+		if (pthread_create(&workers[t], NULL, scan_worker, (void *)t)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (long t = 0; t < nworkers; ++t) {
+		pthread_join(workers[t], NULL);
+	}
+
+	/* the first copy of a page in the image is the original, the rest are duplicates */
+	qsort(pages, npages, sizeof(*pages), page_cmp);
+	for (size_t i = 0; i < npages; ++i) {
+		struct page *pg = pages + i;
+		struct stat_cls *s = st + pg->cls;
+		s->pages++;
+		if (pg->zero) {
+			s->zero++;
+			continue;
+		}
+		for (size_t j = i; 0 < j && pages[j - 1].hash == pg->hash; --j) {
+			if (!memcmp(pages[j - 1].p, pg->p, PAGE)) {
+				s->dup++;
+				pg->compressed = 0;
+				break;
+			}
+		}
+		s->compressed += pg->compressed;
+	}
+
+	for (int c = 0; c < C_NUM; ++c) {
+		st[C_NUM].regions += st[c].regions;
+		st[C_NUM].size += st[c].size;
+		st[C_NUM].filesz += st[c].filesz;
+		st[C_NUM].pages += st[c].pages;
+		st[C_NUM].zero += st[c].zero;
+		st[C_NUM].dup += st[c].dup;
+		st[C_NUM].compressed += st[c].compressed;
+	}
+
+	if (json) {
+		print_json(path, st, ph_notes->p_filesz, io);
+	} else {
+		print_human(path, st, ph_notes->p_filesz, io);
+	}
+	return 0;
+}
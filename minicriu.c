@@ -28,6 +28,7 @@
 
 #include <assert.h>
 #include <alloca.h>
+#include <errno.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -38,14 +39,25 @@
 #include <sched.h>
 #include <sys/mman.h>
 #include <sys/fcntl.h>
+#include <sys/resource.h>
 #include <sys/user.h>
 #include <sys/procfs.h>
 #include <sys/stat.h>
 #include <sys/ucontext.h>
+#include <sys/rseq.h>
+#include <cpuid.h>
+#include <asm/hwcap2.h>
 #include <asm/prctl.h>        /* Definition of ARCH_* constants */
 #include <sys/syscall.h>      /* Definition of SYS_* constants */
 #include <linux/sched.h>
+#include <linux/futex.h>
 #include <linux/elf.h>
+#include <linux/auxvec.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+
+#include "minicriu-image.h"
+#include "minicriu-placement.h"
 
 
 static struct elf_prpsinfo *prpsinfo;
@@ -55,12 +67,34 @@ static struct elf_prpsinfo *prpsinfo;
 static int thread_n;
 static struct elf_prstatus *prstatus[MAX_THREADS];
 static struct user_fpregs_struct *prfpreg[MAX_THREADS];
+static void *xstate[MAX_THREADS];
+static size_t xstate_size[MAX_THREADS];
+/* 64-byte aligned XSAVE (or FXSAVE) image to load */
+static void *fpstate[MAX_THREADS];
+static int fpstate_xsave;
 static char stack[MAX_THREADS][4 * 4096];
 
 static pthread_barrier_t thread_barrier;
 
-static size_t elfsz;
-static void *rawelf;
+static int img_dfd = -1;
+
+static void *notes;
+static size_t notesz;
+
+struct vma {
+	unsigned long start, end;
+};
+
+/* live [vvar]... and [vdso] mappings of the restorer, ascending */
+#define MAX_VDSO_VMAS 4
+static struct vma vdso_vmas[MAX_VDSO_VMAS];
+static int vdso_vma_n;
+static unsigned long vdso_live;
+/* AT_SYSINFO_EHDR of the checkpointed process */
+static unsigned long vdso_orig;
+
+static struct mc_placement placement_buf;
+static const struct mc_placement *placement;
 
 static void arch_prctl(int code, unsigned long addr) {
 	if (syscall(SYS_arch_prctl, code, addr)) {
@@ -69,128 +103,824 @@ static void arch_prctl(int code, unsigned long addr) {
 	}
 }
 
-static void restore(int sig, siginfo_t *info, void *ctx) {
-	ucontext_t *uc = (ucontext_t *) ctx;
-
-	greg_t *gregs = uc->uc_mcontext.gregs;
-	int thread_id = gregs[REG_RDX];
-	struct user_regs_struct *uregs = (void*)prstatus[thread_id]->pr_reg;
-
-	/*printf("restore %d fsbase %llx\n", thread_id, uregs->fs_base);*/
-
-	gregs[REG_R15] = uregs->r15;
-	gregs[REG_R14] = uregs->r14;
-	gregs[REG_R13] = uregs->r13;
-	gregs[REG_R12] = uregs->r12;
-	gregs[REG_RBP] = uregs->rbp;
-	gregs[REG_RBX] = uregs->rbx;
-	gregs[REG_R11] = uregs->r11;
-	gregs[REG_R10] = uregs->r10;
-	gregs[REG_R9] = uregs->r9;
-	gregs[REG_R8] = uregs->r8;
-	gregs[REG_RAX] = uregs->rax;
-	gregs[REG_RCX] = uregs->rcx;
-	gregs[REG_RDX] = uregs->rdx;
-	gregs[REG_RSI] = uregs->rsi;
-	gregs[REG_RDI] = uregs->rdi;
-	/*gregs[REG_] = uregs->orig_rax;*/
-	gregs[REG_RIP] = uregs->rip;
-	/*gregs[REG_] = uregs->cs;*/
-	gregs[REG_EFL] = uregs->eflags;
-	gregs[REG_RSP] = uregs->rsp;
-	/*gregs[REG_] = uregs->ss;*/
-	arch_prctl(ARCH_SET_FS, uregs->fs_base);
-	arch_prctl(ARCH_SET_GS, uregs->gs_base);
-	/*gregs[REG_] = uregs->fs_base;*/
-	/*gregs[REG_] = uregs->gs_base;*/
-	/*gregs[REG_] = uregs->ds;*/
-	/*gregs[REG_] = uregs->es;*/
-	/*gregs[REG_] = uregs->fs;*/
-	/*gregs[REG_] = uregs->gs;*/
+static const struct mc_thread_placement *find_thread_placement(pid_t tid) {
+	for (int i = 0; placement && i < placement->nthreads && i < MC_PLACEMENT_THREADS; ++i) {
+		if (placement->threads[i].tid == tid) {
+			return &placement->threads[i];
+		}
+	}
+	return NULL;
+}
+
+/* Puts the calling thread on the CPUs and nodes it had at checkpoint. */
+static void place_thread(pid_t tid) {
+	const struct mc_thread_placement *t = find_thread_placement(tid);
+	if (!t) {
+		return;
+	}
+	if (CPU_COUNT(&t->affinity) && sched_setaffinity(0, sizeof(t->affinity), &t->affinity)) {
+		perror("WARN: sched_setaffinity");
+	}
+	struct sched_param param = { .sched_priority = t->priority };
+	if (0 <= t->policy && sched_setscheduler(0, t->policy, &param)) {
+		perror("WARN: sched_setscheduler");
+	}
+	if ((t->policy == SCHED_OTHER || t->policy == SCHED_BATCH) &&
+			setpriority(PRIO_PROCESS, 0, t->nice)) {
+		perror("WARN: setpriority");
+	}
+	if (0 <= t->mempolicy &&
+			syscall(SYS_set_mempolicy, t->mempolicy, t->nodes, MC_MAX_NODES) &&
+			errno != ENOSYS) {
+		perror("WARN: set_mempolicy");
+	}
+}
+
+/* <sys/auxv.h> brings <elf.h>, which conflicts with <linux/elf.h> */
+extern unsigned long getauxval(unsigned long type);
+
+/* XSAVE header, right after the legacy FXSAVE area */
+#define XSAVE_HDR 512
+#define XFEATURE_XTILEDATA 18
+
+static uint64_t xgetbv(unsigned idx) {
+	uint32_t lo, hi;
+	asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (idx));
+	return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * Copies the FP state of each thread out of the notes into buffers
+ * xrstor/fxrstor accept: aligned, and with only the features this CPU
+ * has enabled.
+ */
+static int prepare_fpstate(void) {
+	unsigned eax, ebx, ecx, edx;
+	__cpuid(1, eax, ebx, ecx, edx);
+	fpstate_xsave = !!(ecx & bit_OSXSAVE);
+
+	size_t size = 512;
+	uint64_t xcr0 = 0;
+	if (fpstate_xsave) {
+		xcr0 = xgetbv(0);
+		__cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+		size = ebx;
+		for (int i = 0; i < thread_n; ++i) {
+			if (!xstate[i]) {
+				fpstate_xsave = 0;
+			} else if (size < xstate_size[i]) {
+				size = xstate_size[i];
+			}
+		}
+	}
+	size = align_up(size, 64);
+
+	char *buf = mmap(NULL, align_up(thread_n * size, 4096), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap fpstate");
+		return 1;
+	}
+	for (int i = 0; i < thread_n; ++i, buf += size) {
+		if (!fpstate_xsave) {
+			if (prfpreg[i]) {
+				memcpy(buf, prfpreg[i], 512);
+				fpstate[i] = buf;
+			}
+			continue;
+		}
+		memcpy(buf, xstate[i], xstate_size[i]);
+		uint64_t *hdr = (uint64_t *)(buf + XSAVE_HDR);
+		/* standard format, the rest of the header is reserved */
+		hdr[0] &= xcr0;
+		memset(hdr + 1, 0, 56);
+		if ((hdr[0] & 1UL << XFEATURE_XTILEDATA) &&
+				syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)) {
+			perror("WARN: AMX permission");
+			hdr[0] &= ~(1UL << XFEATURE_XTILEDATA);
+		}
+		fpstate[i] = buf;
+	}
+	return 0;
+}
+
+/*
+ * Switches the calling thread to the checkpointed one: signal mask,
+ * TLS, FP/vector state, general registers, and a jump to its rip.
+ */
+static void __attribute__((noreturn)) resume(int thread_id) {
+	const struct elf_prstatus *prs = prstatus[thread_id];
+	const struct user_regs_struct *uregs = (void*)prs->pr_reg;
+
+	/* popped in order, rsp last; it points to the frame below */
+	unsigned long regs[] = {
+		uregs->r15, uregs->r14, uregs->r13, uregs->r12,
+		uregs->rbp, uregs->rbx, uregs->r11, uregs->r10,
+		uregs->r9, uregs->r8, uregs->rcx, uregs->rdx,
+		uregs->rsi, uregs->rdi, uregs->rax,
+		uregs->rsp - 128 - 16,
+	};
+	/* rflags and rip for popfq and ret, below the red zone of the target */
+	unsigned long *frame = (unsigned long *)(uregs->rsp - 128 - 16);
+	frame[0] = uregs->eflags;
+	frame[1] = uregs->rip;
+
+	unsigned long fs_base = uregs->fs_base;
+	unsigned long gs_base = uregs->gs_base;
+	unsigned long sighold = prs->pr_sighold;
+	void *fp = fpstate[thread_id];
+
+	place_thread(prs->pr_pid);
 
 	/*
-	* 	Here we synchronize the restoration of threads so their
-	*	SIGSIS signal handler was not replaced by old one
-	*	after the current thread recovery.
-	*/
+	 * The last thread to pass drops what only the restorer needed. The
+	 * rest of the restorer, its code and stacks included, is still in use
+	 * until every thread has jumped out, and it is unmapped by the client
+	 * library after that.
+	 */
+	if (pthread_barrier_wait(&thread_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		munmap(notes, notesz);
+		if (img_fd != STDIN_FILENO) {
+			close(img_fd);
+		}
+	}
 
-	pthread_barrier_wait(&thread_barrier);
+	if (syscall(SYS_rt_sigprocmask, SIG_SETMASK, &sighold, NULL, sizeof(sighold))) {
+		perror("WARN: sigprocmask");
+	}
 
-#if 0
-	if (thread_id == 0) {
-		munmap(rawelf, elfsz);
+	/* no TLS access past this point, errno included */
+	if (getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE) {
+		asm volatile("wrgsbase %0" : : "r" (gs_base) : "memory");
+		asm volatile("wrfsbase %0" : : "r" (fs_base) : "memory");
+	} else {
+		arch_prctl(ARCH_SET_GS, gs_base);
+		/* TLS is the old one on failure, so this still can report */
+		arch_prctl(ARCH_SET_FS, fs_base);
 	}
-#endif
 
-#if 0
-	volatile int block = 1;
-	while (block) {
+	if (fp && fpstate_xsave) {
+		asm volatile("xrstor64 (%0)" : : "r" (fp), "a" (-1), "d" (-1) : "memory");
+	} else if (fp) {
+		asm volatile("fxrstor64 (%0)" : : "r" (fp) : "memory");
 	}
-#endif
+
+	asm volatile(
+		"mov %0, %%rsp\n\t"
+		"pop %%r15\n\t"
+		"pop %%r14\n\t"
+		"pop %%r13\n\t"
+		"pop %%r12\n\t"
+		"pop %%rbp\n\t"
+		"pop %%rbx\n\t"
+		"pop %%r11\n\t"
+		"pop %%r10\n\t"
+		"pop %%r9\n\t"
+		"pop %%r8\n\t"
+		"pop %%rcx\n\t"
+		"pop %%rdx\n\t"
+		"pop %%rsi\n\t"
+		"pop %%rdi\n\t"
+		"pop %%rax\n\t"
+		"pop %%rsp\n\t"
+		"popfq\n\t"
+		"ret $128\n\t"
+		: : "r" (regs) : "memory");
+	__builtin_unreachable();
 }
 
-static unsigned long align_up(unsigned long v, unsigned p) {
-	return (v + p - 1) & ~(p - 1);
+#define URING_DEPTH 64
+/* a chunk is a checksum block */
+#define URING_CHUNK IMG_CSUM_BLOCK
+
+struct uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ringsz, cq_ringsz;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqesz;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *u, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		return -1;
+	}
+
+	u->sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->sq_ringsz < u->cq_ringsz) {
+			u->sq_ringsz = u->cq_ringsz;
+		}
+		u->cq_ringsz = 0;
+	}
+	u->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ring = mmap(NULL, u->sq_ringsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = u->cq_ringsz ? mmap(NULL, u->cq_ringsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING) : u->sq_ring;
+	u->sqes = mmap(NULL, u->sqesz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		perror("mmap io_uring");
+		if (u->sqes != MAP_FAILED) {
+			munmap(u->sqes, u->sqesz);
+		}
+		if (u->cq_ringsz && u->cq_ring != MAP_FAILED) {
+			munmap(u->cq_ring, u->cq_ringsz);
+		}
+		if (u->sq_ring != MAP_FAILED) {
+			munmap(u->sq_ring, u->sq_ringsz);
+		}
+		close(u->fd);
+		return -1;
+	}
+
+	u->sq_head = u->sq_ring + p.sq_off.head;
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+	return 0;
 }
 
-static int clonefn(void *arg) {
-	int r = syscall(SYS_tkill, syscall(SYS_gettid), SIGSYS,
-			/* extra arg to _signal handler_ */ arg);
-	fprintf(stderr, "should not reach here (thread %d)\n", (int)(long)arg);
-	return 1;
+static void uring_fini(struct uring *u) {
+	munmap(u->sqes, u->sqesz);
+	if (u->cq_ringsz) {
+		munmap(u->cq_ring, u->cq_ringsz);
+	}
+	munmap(u->sq_ring, u->sq_ringsz);
+	close(u->fd);
 }
 
-int main(int argc, char *argv[]) {
-	const char* elfpath = argv[1];
+struct chunk {
+	char *buf;
+	size_t len;
+	off_t off;
+	int seg;
+	size_t block;
+	uint32_t crc;
+};
+
+static void uring_queue(struct uring *u, struct chunk *c, int slot) {
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	/* O_DIRECT only takes block aligned requests */
+	int aligned = !(((uintptr_t)c->buf | c->off | c->len) & (4096 - 1));
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = 0 <= img_dfd && aligned ? img_dfd : img_fd;
+	sqe->off = c->off;
+	sqe->addr = (uintptr_t)c->buf;
+	sqe->len = c->len;
+	sqe->user_data = slot;
 
-	int fd = open(elfpath, O_RDONLY);
-	if (fd < 0) {
-		perror("open");
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Populates PT_LOAD segments with up to URING_DEPTH reads of URING_CHUNK
+ * bytes in flight. Returns 1 if io_uring is not available, so the caller
+ * can populate the segments synchronously.
+ */
+static int populate_uring(const Elf64_Phdr *phdrs, int phnum) {
+	struct uring u;
+	if (uring_init(&u, URING_DEPTH)) {
 		return 1;
 	}
 
-	struct stat st;
-	if (fstat(fd, &st)) {
-		perror("stat");
-		return 1;
+	struct chunk chunks[URING_DEPTH];
+	int idle[URING_DEPTH], resub[URING_DEPTH];
+	int nidle = 0, nresub = 0, inflight = 0;
+	for (int i = 0; i < URING_DEPTH; ++i) {
+		idle[nidle++] = i;
+	}
+
+	/* read chunks still to be hashed, the slots are already reused */
+	struct chunk done[URING_DEPTH];
+	int ndone = 0;
+	int csum = img_csum_wanted();
+
+	int seg = 0;
+	size_t segdone = 0;
+	unsigned pending = 0;
+	int ret = 0;
+
+	while (1) {
+		while (nresub) {
+			int slot = resub[--nresub];
+			uring_queue(&u, &chunks[slot], slot);
+			++pending;
+			++inflight;
+		}
+		while (nidle && seg < phnum) {
+			const Elf64_Phdr *ph = phdrs + seg;
+			if (ph->p_type != PT_LOAD || segdone == ph->p_filesz) {
+				++seg;
+				segdone = 0;
+				continue;
+			}
+			size_t len = ph->p_filesz - segdone;
+			int slot = idle[--nidle];
+			chunks[slot] = (struct chunk) {
+				.buf = (char *)ph->p_vaddr + segdone,
+				.len = len < URING_CHUNK ? len : URING_CHUNK,
+				.off = ph->p_offset + segdone,
+				.seg = seg,
+				.block = segdone / URING_CHUNK,
+			};
+			segdone += chunks[slot].len;
+			uring_queue(&u, &chunks[slot], slot);
+			++pending;
+			++inflight;
+		}
+
+		/* the device works on the new reads while the completed are hashed */
+		if (ndone && pending) {
+			long r = syscall(SYS_io_uring_enter, u.fd, pending, 0, 0, NULL, 0);
+			if (0 < r) {
+				pending -= r;
+			}
+		}
+		for (int i = 0; i < ndone; ++i) {
+			struct chunk *c = &done[i];
+			if (img_csum_check(c->seg, c->block, crc32c(c->crc, c->buf, c->len))) {
+				ret = -1;
+				break;
+			}
+		}
+		ndone = 0;
+		if (ret || !inflight) {
+			break;
+		}
+
+		long r = syscall(SYS_io_uring_enter, u.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			ret = -1;
+			break;
+		}
+		if (0 < r) {
+			pending -= r;
+		}
+
+		unsigned head = *u.cq_head;
+		unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+			int slot = cqe->user_data;
+			struct chunk *c = &chunks[slot];
+			int res = cqe->res;
+			--inflight;
+
+			if (0 < res && res < c->len) {
+				if (csum) {
+					/* the pages are there, as the kernel just wrote them */
+					c->crc = crc32c(c->crc, c->buf, res);
+				}
+				c->buf += res;
+				c->len -= res;
+				c->off += res;
+				resub[nresub++] = slot;
+				continue;
+			}
+			if (res == -EFAULT || res == -EINVAL || res == -EOPNOTSUPP) {
+				/*
+				 * Unbacked target pages, a request O_DIRECT refused or
+				 * no IORING_OP_READ on this kernel: do it the slow way.
+				 * It hashes as it reads, which leaves nothing to hash.
+				 */
+				res = img_read_crc(c->buf, c->len, c->off, csum ? &c->crc : NULL) ? -EIO : 0;
+				if (!res) {
+					c->buf += c->len;
+					c->len = 0;
+				}
+			} else if (res < 0) {
+				errno = -res;
+				perror("io_uring read");
+			} else if (res == 0) {
+				fprintf(stderr, "image truncated at offset %lx\n", c->off);
+			}
+			if (res != c->len) {
+				fprintf(stderr, "cannot populate %p len %zx off %lx\n", c->buf, c->len, c->off);
+				ret = -1;
+				break;
+			}
+			if (csum) {
+				done[ndone++] = *c;
+			}
+			idle[nidle++] = slot;
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+		if (ret) {
+			break;
+		}
+	}
+
+	uring_fini(&u);
+	return ret;
+}
+
+static int populate_sync(const Elf64_Phdr *phdrs, int phnum) {
+	/*
+	 * Segments are populated in phdr order, which is also the file order
+	 * of the core, so a streamed image is read front to back.
+	 */
+	int csum = img_csum_wanted();
+	for (int i = 0; i < phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		for (size_t done = 0, b = 0; done < ph->p_filesz; done += IMG_CSUM_BLOCK, ++b) {
+			size_t len = ph->p_filesz - done;
+			uint32_t crc = 0;
+			if (img_read_crc((char *)ph->p_vaddr + done, len < IMG_CSUM_BLOCK ? len : IMG_CSUM_BLOCK,
+						ph->p_offset + done, csum ? &crc : NULL)) {
+				fprintf(stderr, "cannot populate vaddr %16llx filesz %16llx off %16llx\n",
+						ph->p_vaddr, ph->p_filesz, ph->p_offset);
+				return -1;
+			}
+			if (csum && img_csum_check(i, b, crc)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int overlaps_load(const Elf64_Phdr *phdrs, int phnum, unsigned long start, unsigned long end) {
+	for (int i = 0; i < phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i;
+		if (ph->p_type == PT_LOAD && ph->p_vaddr < end && start < ph->p_vaddr + ph->p_memsz) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void vdso_find_live(void) {
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (!f) {
+		perror("open maps");
+		return;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), f) && vdso_vma_n < MAX_VDSO_VMAS) {
+		if (!strstr(line, "[vvar") && !strstr(line, "[vdso]")) {
+			continue;
+		}
+		struct vma *v = &vdso_vmas[vdso_vma_n++];
+		sscanf(line, "%lx-%lx", &v->start, &v->end);
+		if (strstr(line, "[vdso]")) {
+			vdso_live = v->start;
+		}
 	}
+	fclose(f);
+}
+
+/*
+ * Moves the live vvar and vdso to start at addr, keeping their layout.
+ * libc of the restorer keeps pointing to the old place, so no vdso
+ * function can be called afterwards.
+ */
+static int vdso_move(unsigned long addr) {
+	long delta = addr - vdso_vmas[0].start;
+	for (int j = 0; j < vdso_vma_n; ++j) {
+		/* do not step on a mapping still to be moved */
+		struct vma *v = &vdso_vmas[0 < delta ? vdso_vma_n - 1 - j : j];
+		void *to = (void *)(v->start + delta);
+		if (mremap((void *)v->start, v->end - v->start, v->end - v->start,
+					MREMAP_MAYMOVE | MREMAP_FIXED, to) != to) {
+			perror("mremap vdso");
+			return -1;
+		}
+		v->start += delta;
+		v->end += delta;
+	}
+	vdso_live += delta;
+	return 0;
+}
+
+/*
+ * Moves the live vdso to a place that is free both now and in the target
+ * layout, as close to near as possible.
+ */
+static int vdso_park(const Elf64_Phdr *phdrs, int phnum, unsigned long near) {
+	unsigned long len = vdso_vmas[vdso_vma_n - 1].end - vdso_vmas[0].start;
+	unsigned long best = 0, bestdist = -1UL;
+	for (int i = 0; i < 2 * phnum; ++i) {
+		const Elf64_Phdr *ph = phdrs + i / 2;
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		/* right below or right above a target mapping */
+		unsigned long addr = i % 2 ? align_up(ph->p_vaddr + ph->p_memsz, 4096) : ph->p_vaddr - len;
+		unsigned long dist = addr < near ? near - addr : addr - near;
+		if (bestdist <= dist || addr < 0x10000 || 1UL << 47 <= addr + len ||
+				overlaps_load(phdrs, phnum, addr, addr + len)) {
+			continue;
+		}
+		void *r = mmap((void *)addr, len, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (r != (void *)addr) {
+			if (r != MAP_FAILED) {
+				munmap(r, len);
+			}
+			continue;
+		}
+		if (best) {
+			munmap((void *)best, len);
+		}
+		best = addr;
+		bestdist = dist;
+	}
+	if (!best) {
+		fprintf(stderr, "no place to park vdso\n");
+		return -1;
+	}
+	return vdso_move(best);
+}
+
+struct vdso_image {
+	unsigned long bias;
+	const Elf64_Sym *sym;
+	int symn;
+	const char *str;
+};
+
+static int vdso_parse(unsigned long base, size_t len, struct vdso_image *v) {
+	const Elf64_Ehdr *eh = (void *)base;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+			len < eh->e_phoff + eh->e_phnum * sizeof(Elf64_Phdr) ||
+			len < eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr)) {
+		return -1;
+	}
+
+	const Elf64_Phdr *ph = (void *)(base + eh->e_phoff);
+	v->bias = base;
+	for (int i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type == PT_LOAD) {
+			v->bias = base - ph[i].p_vaddr;
+			break;
+		}
+	}
+
+	const Elf64_Shdr *sh = (void *)(base + eh->e_shoff);
+	for (int i = 0; i < eh->e_shnum; ++i) {
+		if (sh[i].sh_type == SHT_DYNSYM && sh[i].sh_link < eh->e_shnum) {
+			v->sym = (void *)(base + sh[i].sh_offset);
+			v->symn = sh[i].sh_size / sizeof(Elf64_Sym);
+			v->str = (void *)(base + sh[sh[i].sh_link].sh_offset);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The checkpointed vdso comes from a different kernel: redirect each of
+ * its entry points to the same function of the live vdso, which is
+ * expected to be parked within the reach of a rel32 jump.
+ */
+static void vdso_patch(size_t origlen) {
+	size_t livelen = vdso_vmas[vdso_vma_n - 1].end - vdso_live;
+	struct vdso_image orig, live;
+	if (vdso_parse(vdso_orig, origlen, &orig) || vdso_parse(vdso_live, livelen, &live)) {
+		fprintf(stderr, "WARN: cannot parse vdso, time calls will be stale\n");
+		return;
+	}
+
+	for (int i = 0; i < orig.symn; ++i) {
+		const Elf64_Sym *os = &orig.sym[i];
+		if (ELF64_ST_TYPE(os->st_info) != STT_FUNC || os->st_shndx == SHN_UNDEF) {
+			continue;
+		}
+		const char *name = orig.str + os->st_name;
+		const Elf64_Sym *ls = NULL;
+		for (int j = 0; j < live.symn && !ls; ++j) {
+			if (ELF64_ST_TYPE(live.sym[j].st_info) == STT_FUNC &&
+					!strcmp(name, live.str + live.sym[j].st_name)) {
+				ls = &live.sym[j];
+			}
+		}
+		unsigned long from = orig.bias + os->st_value;
+		long rel = ls ? live.bias + ls->st_value - (from + 5) : 0;
+		if (!ls || os->st_size < 5 || rel != (int)rel) {
+			fprintf(stderr, "WARN: cannot redirect vdso %s\n", name);
+			continue;
+		}
+		/* jmp rel32 */
+		int32_t rel32 = rel;
+		*(unsigned char *)from = 0xe9;
+		memcpy((void *)(from + 1), &rel32, sizeof(rel32));
+	}
+}
+
+/*
+ * Puts the live vdso in place of the checkpointed one, so time calls of
+ * the restored process keep reading current data from the vvar instead
+ * of the stale copy in the image. Must be called with the segments
+ * populated but still writable.
+ */
+static void vdso_install(Elf64_Phdr *phdrs, int phnum) {
+	if (!vdso_live || !vdso_orig) {
+		return;
+	}
+	const Elf64_Phdr *orig = NULL;
+	for (int i = 0; i < phnum; ++i) {
+		if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr == vdso_orig) {
+			orig = phdrs + i;
+		}
+	}
+	if (!orig || orig->p_filesz != orig->p_memsz) {
+		fprintf(stderr, "WARN: vdso is not in the image\n");
+		return;
+	}
+
+	/* vvar is at a fixed offset below the vdso of the same kernel */
+	unsigned long vvarlen = vdso_live - vdso_vmas[0].start;
+	unsigned long len = vdso_vmas[vdso_vma_n - 1].end - vdso_live;
+	if (orig->p_memsz == len && !memcmp((void *)vdso_orig, (void *)vdso_live, len) &&
+			!vdso_move(vdso_orig - vvarlen)) {
+		for (int i = 0; i < phnum; ++i) {
+			Elf64_Phdr *ph = phdrs + i;
+			if (ph->p_type == PT_LOAD && vdso_orig - vvarlen <= ph->p_vaddr
+					&& ph->p_vaddr < vdso_orig + len) {
+				ph->p_type = PT_NULL;
+			}
+		}
+		return;
+	}
+	if (!vdso_park(phdrs, phnum, vdso_orig)) {
+		vdso_patch(orig->p_memsz);
+	}
+}
+
+/*
+ * The dumping thread passed the address of its placement record in r8 of
+ * kill(pid, SIGABRT, 1313, ...).
+ */
+static unsigned long find_placement(void) {
+	for (int i = 0; i < thread_n; ++i) {
+		struct user_regs_struct *uregs = (void*)prstatus[i]->pr_reg;
+		if (uregs->orig_rax == SYS_kill && uregs->rdx == 1313) {
+			return uregs->r8;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tells if the placement record at addr lies wholly in populated segments,
+ * and reads it from the image into buf unless that is NULL. The record is
+ * in .bss of the client, so it usually starts in the file-backed page of
+ * .data and runs on into the anonymous mapping after it. Images of older
+ * clients match kill(..., 1313) too, but their r8 is whatever was left
+ * there, so the address is not trusted otherwise.
+ */
+static int placement_in_image(const Elf64_Phdr *phdrs, int phnum, unsigned long addr, void *buf) {
+	unsigned long cur = addr, end = addr + sizeof(placement_buf);
+	if (end < addr) {
+		return 0;
+	}
+	while (cur < end) {
+		const Elf64_Phdr *ph = NULL;
+		for (int i = 0; i < phnum && !ph; ++i) {
+			if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr <= cur &&
+					cur - phdrs[i].p_vaddr < phdrs[i].p_filesz) {
+				ph = phdrs + i;
+			}
+		}
+		if (!ph) {
+			return 0;
+		}
+		unsigned long next = ph->p_vaddr + ph->p_filesz;
+		next = next < end ? next : end;
+		if (buf && img_read((char *)buf + (cur - addr), next - cur,
+					ph->p_offset + cur - ph->p_vaddr)) {
+			return 0;
+		}
+		cur = next;
+	}
+	return 1;
+}
+
+/* Reads the placement record from the image, as segments are not populated yet. */
+static int read_placement(const Elf64_Phdr *phdrs, int phnum, unsigned long addr) {
+	if (!placement_in_image(phdrs, phnum, addr, &placement_buf)) {
+		return -1;
+	}
+	return placement_buf.magic == MC_PLACEMENT_MAGIC ? 0 : -1;
+}
+
+/*
+ * Sets each region to prefer the node most of its pages were on. Done
+ * before populating, the pages are allocated there regardless of which
+ * thread faults them in. With MPOL_MF_MOVE, pages already populated are
+ * migrated.
+ */
+static void place_regions(unsigned flags) {
+	for (int i = 0; placement && i < placement->nregions && i < MC_PLACEMENT_REGIONS; ++i) {
+		const struct mc_region_placement *r = &placement->regions[i];
+		if (r->node < 0 || MC_MAX_NODES <= r->node) {
+			continue;
+		}
+		unsigned long nodes[MC_MAX_NODES / (8 * sizeof(long))] = { 0 };
+		nodes[r->node / (8 * sizeof(long))] = 1UL << (r->node % (8 * sizeof(long)));
+		if (syscall(SYS_mbind, r->start, r->end - r->start, MPOL_PREFERRED,
+					nodes, MC_MAX_NODES, flags)) {
+			if (errno == ENOSYS) {
+				return;
+			}
+			fprintf(stderr, "WARN: mbind %lx-%lx node %d: %m\n", r->start, r->end, r->node);
+		}
+	}
+}
+
+/* Puts back the memory policy the regions had at checkpoint. */
+static void restore_region_policy(void) {
+	for (int i = 0; placement && i < placement->nregions && i < MC_PLACEMENT_REGIONS; ++i) {
+		const struct mc_region_placement *r = &placement->regions[i];
+		if (r->mempolicy < 0) {
+			continue;
+		}
+		if (syscall(SYS_mbind, r->start, r->end - r->start, r->mempolicy,
+					r->nodes, MC_MAX_NODES, 0)) {
+			if (errno == ENOSYS) {
+				return;
+			}
+			fprintf(stderr, "WARN: mbind %lx-%lx policy %d: %m\n", r->start, r->end, r->mempolicy);
+		}
+	}
+}
+
+static int clonefn(void *arg) {
+	resume((int)(uintptr_t)arg);
+}
 
-	elfsz = align_up(st.st_size, 4096);
-	rawelf = mmap(NULL, elfsz, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (rawelf == MAP_FAILED) {
-		perror("mmap");
+int main(int argc, char *argv[]) {
+	int direct = 0;
+	int sync = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "ds")) != -1) {
+		switch (opt) {
+		case 'd': direct = 1; break;
+		case 's': sync = 1; break;
+		default: optind = argc; break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-d] [-s] <core | ->\n"
+				"  -d  read segments with O_DIRECT, bypassing the page cache\n"
+				"  -s  read segments synchronously instead of with io_uring\n",
+				argv[0]);
 		return 1;
 	}
-	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) rawelf;
-	if (strncmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
-		fprintf(stderr, "ELF header mismatch\n");
+	const char* elfpath = argv[optind];
+
+	if (img_open(elfpath)) {
 		return 1;
 	}
 
-	if (!ehdr->e_phoff ||
-			!ehdr->e_phnum ||
-			ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
-		printf("bad ehdr\n");
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr *phdrs;
+	if (img_read_headers(&ehdr, &phdrs)) {
+		return 1;
+	}
+	if (img_csum_open(phdrs, ehdr.e_phnum)) {
 		return 1;
 	}
-	const Elf64_Phdr *phdrs = (const Elf64_Phdr *) (rawelf + ehdr->e_phoff);
 
-	const Elf64_Phdr *ph_notes = NULL;
-	for (int i = 0; i < ehdr->e_phnum; ++i) {
-		const Elf64_Phdr *ph = phdrs + i;
-		if (ph->p_type == PT_NOTE) {
-			ph_notes = ph;
-			break;
-		}
+	vdso_find_live();
+	if (vdso_live && overlaps_load(phdrs, ehdr.e_phnum, vdso_vmas[0].start,
+				vdso_vmas[vdso_vma_n - 1].end) &&
+			vdso_park(phdrs, ehdr.e_phnum, vdso_vmas[0].start)) {
+		return 1;
 	}
 
+	const Elf64_Phdr *ph_notes = img_find_phdr(phdrs, ehdr.e_phnum, PT_NOTE);
 	if (!ph_notes) {
 		fprintf(stderr, "cannot find PT_NOTE\n");
 		return 1;
 	}
 
-	for (int i = 0; i < ehdr->e_phnum; ++i) {
-		const Elf64_Phdr *ph = phdrs + i;
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
+		Elf64_Phdr *ph = phdrs + i;
 		if (ph->p_type != PT_LOAD) {
 			continue;
 		}
@@ -208,51 +938,55 @@ int main(int argc, char *argv[]) {
 						ph->p_vaddr, ph->p_filesz, ph->p_offset);
 			} else {
 				fprintf(stderr, "WARN: mmap phdr target mismatch %llx -> %p\n", ph->p_vaddr, addr);
+				munmap(addr, ph->p_memsz);
 			}
+			/* nowhere to put the content, it is skipped when populating */
+			ph->p_type = PT_NULL;
 		}
 	}
 
-	off_t noff = ph_notes->p_offset;
-	while (noff < ph_notes->p_offset + ph_notes->p_filesz) {
-		Elf64_Nhdr *nh = rawelf + noff;
-		off_t nameoff = noff + sizeof(*nh);
-		off_t doff = nameoff + align_up(nh->n_namesz, 4);
-		noff = doff + align_up(nh->n_descsz, 4);
+	/*
+	 * The target layout is in place, so the notes buffer is allocated
+	 * where it cannot be overwritten by a target mapping.
+	 */
+	notes = img_read_notes(ph_notes, &notesz);
+	if (!notes) {
+		return 1;
+	}
 
-		/*printf("%16s 0x%08lx 0x%08lx\n", rawelf + nameoff, nh->n_type, nh->n_descsz);*/
+	size_t noff = 0;
+	struct img_note n;
+	while (img_next_note(notes, ph_notes->p_filesz, &noff, &n)) {
+		/*printf("%16s 0x%08lx 0x%08lx\n", n.name, n.nh->n_type, n.nh->n_descsz);*/
 		void *target = NULL;
-		if (!strcmp("CORE", rawelf + nameoff)) {
-			switch (nh->n_type) {
+		if (!strcmp("CORE", n.name)) {
+			switch (n.nh->n_type) {
 			case NT_PRPSINFO: target = &prpsinfo; break;
 			case NT_PRSTATUS: target = &prstatus[thread_n++]; break;
-			case NT_PRFPREG:  target = &prfpreg[thread_n];  break;
+			case NT_PRFPREG:  target = &prfpreg[thread_n - 1];  break;
+			case NT_AUXV: vdso_orig = img_auxv(&n, AT_SYSINFO_EHDR); break;
 			default: break;
 			}
 		}
-		if (!strcmp("LINUX", rawelf + nameoff)) {
-			switch (nh->n_type) {
-			case NT_X86_XSTATE: break;
+		if (!strcmp("LINUX", n.name)) {
+			switch (n.nh->n_type) {
+			case NT_X86_XSTATE:
+				target = &xstate[thread_n - 1];
+				xstate_size[thread_n - 1] = n.nh->n_descsz;
+				break;
 			default: break;
 			}
 		}
 		if (target) {
-			*(void**)target = rawelf + doff;
+			*(void**)target = n.desc;
 		}
 
-		if (!strcmp("CORE", rawelf + nameoff) && nh->n_type == NT_FILE) {
-			struct {
-				long count;
-				long page_size;
-				struct filemap {
-					long start;
-					long end;
-					long file_ofs;
-				} map[0];
-			} *fh = rawelf + doff;
+		if (!strcmp("CORE", n.name) && n.nh->n_type == NT_FILE) {
+			struct img_nt_file *fh = n.desc;
 
 			char *name = (char*)(&fh->map[fh->count]);
 			for (int i = 0; i < fh->count; ++i) {
-				struct filemap *fm = &fh->map[i];
+				struct img_filemap *fm = &fh->map[i];
 
 				int fd = open(name, O_RDONLY);
 				munmap((void*)fm->start, fm->end - fm->start);
@@ -277,12 +1011,48 @@ int main(int argc, char *argv[]) {
 	}
 
 
-	for (int i = 0; i < ehdr->e_phnum; ++i) {
+	unsigned long placement_addr = find_placement();
+	if (placement_addr && !img_stream && !read_placement(phdrs, ehdr.e_phnum, placement_addr)) {
+		placement = &placement_buf;
+		place_regions(0);
+	}
+
+	int populated = 1;
+	if (!img_stream && !sync) {
+		if (direct) {
+			img_dfd = open(elfpath, O_RDONLY | O_DIRECT);
+			if (img_dfd < 0) {
+				perror("WARN: open O_DIRECT");
+			}
+		}
+		populated = populate_uring(phdrs, ehdr.e_phnum);
+		if (0 <= img_dfd) {
+			close(img_dfd);
+		}
+	}
+	if (populated == 1) {
+		populated = populate_sync(phdrs, ehdr.e_phnum);
+	}
+	if (populated || img_csum_close()) {
+		return 1;
+	}
+
+	if (placement_addr && !placement &&
+			placement_in_image(phdrs, ehdr.e_phnum, placement_addr, NULL) &&
+			((struct mc_placement *)placement_addr)->magic == MC_PLACEMENT_MAGIC) {
+		/* a streamed image is only seen once, so move what is populated */
+		placement = (struct mc_placement *)placement_addr;
+		place_regions(MPOL_MF_MOVE);
+	}
+	restore_region_policy();
+
+	vdso_install(phdrs, ehdr.e_phnum);
+
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
 		const Elf64_Phdr *ph = phdrs + i;
 		if (ph->p_type != PT_LOAD) {
 			continue;
 		}
-		pread(fd, (void*)ph->p_vaddr, ph->p_filesz, ph->p_offset);
 
 		int mprot = 0;
 		mprot |= ph->p_flags & PF_R ? PROT_READ : 0;
@@ -290,14 +1060,9 @@ int main(int argc, char *argv[]) {
 		mprot |= ph->p_flags & PF_X ? PROT_EXEC : 0;
 		mprotect((void*)ph->p_vaddr, ph->p_memsz, mprot);
 	}
+	free(phdrs);
 
-	struct sigaction sa = {
-		.sa_sigaction = restore,
-		.sa_flags = SA_SIGINFO
-	};
-	sigemptyset(&sa.sa_mask);
-	if (sigaction(SIGSYS, &sa, NULL)) {
-		perror("sigaction");
+	if (prepare_fpstate()) {
 		return 1;
 	}
 
@@ -330,6 +1095,21 @@ int main(int argc, char *argv[]) {
 #endif
 	}
 
+	/*
+	 * libc registered rseq and robust futexes of this thread in the TLS of
+	 * the restorer, which is unmapped after restore. The kernel must not
+	 * keep writing there.
+	 */
+	if (__rseq_size) {
+		/* registered with at least the original struct size */
+		size_t len = __rseq_size < sizeof(struct rseq) ? sizeof(struct rseq) : __rseq_size;
+		if (syscall(SYS_rseq, (char *)__builtin_thread_pointer() + __rseq_offset,
+					len, RSEQ_FLAG_UNREGISTER, RSEQ_SIG)) {
+			perror("rseq unregister");
+		}
+	}
+	syscall(SYS_set_robust_list, NULL, sizeof(struct robust_list_head));
+
 	clonefn((void*)(uintptr_t)0);
 	fprintf(stderr, "should not reach here\n");
 	return 0;
@@ -25,6 +25,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -75,8 +77,155 @@ void *thread(void *arg) {
 	}
 }
 
+/*
+ * Snapshot and rollback: both threads write their heap and stack and map
+ * new memory, and one maps a file over anonymous memory. Each rollback
+ * has to undo all of it. The count of rollbacks is kept in shared memory,
+ * which is not rolled back. At last a file mapping is removed, which a
+ * rollback cannot bring back, so it has to refuse.
+ */
+struct snap_shared {
+	volatile int rollbacks;
+	void *maps[2];
+};
+static struct snap_shared *snap_sh;
+static volatile int snap_ready, snap_go, snap_done;
+static int *snap_heap[2];
+static volatile int *snap_stack[2];
+static int *snap_anon;
+static int *snap_file;
+static int snap_fd;
+
+/* Tells if addr is in anonymous memory. */
+static int snap_is_anon(void *addr) {
+	FILE *f = fopen("/proc/self/maps", "r");
+	char line[4096];
+	int anon = 0;
+	while (f && fgets(line, sizeof(line), f)) {
+		unsigned long start, end, ino;
+		if (sscanf(line, "%lx-%lx %*s %*s %*s %lu", &start, &end, &ino) == 3 &&
+				start <= (unsigned long)addr && (unsigned long)addr < end) {
+			anon = !ino;
+		}
+	}
+	if (f) {
+		fclose(f);
+	}
+	return anon;
+}
+
+static void snap_dirty(int i) {
+	*snap_heap[i] = 2;
+	*snap_stack[i] = 2;
+	int *m = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	*m = 2;
+	snap_sh->maps[i] = m;
+	if (i == 0) {
+		mmap(snap_anon, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snap_fd, 0);
+	}
+}
+
+static int snap_check(int i) {
+	return *snap_heap[i] == 1 && *snap_stack[i] == 1 &&
+		msync(snap_sh->maps[i], 4096, MS_ASYNC) && errno == ENOMEM &&
+		*snap_anon == 1 && snap_is_anon(snap_anon);
+}
+
+static void *snap_thread(void *arg) {
+
+	minicriu_register_new_thread();
+
+	volatile int local = 1;
+	snap_stack[1] = &local;
+	snap_heap[1] = malloc(sizeof(int));
+	*snap_heap[1] = 1;
+	snap_ready = 1;
+
+	while (1) {
+		if (snap_go) {
+			snap_dirty(1);
+			snap_go = 0;
+			snap_done = 1;
+		}
+		usleep(1000);
+	}
+}
+
+static int snap_test(void) {
+
+	snap_sh = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (snap_sh == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	snap_fd = open("./file", O_RDONLY);
+	if (snap_fd < 0) {
+		perror("open");
+		return 1;
+	}
+	snap_anon = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	snap_file = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap_fd, 0);
+	if (snap_anon == MAP_FAILED || snap_file == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	*snap_anon = 1;
+	*snap_file = 1;
+
+	volatile int local = 1;
+	snap_stack[0] = &local;
+	snap_heap[0] = malloc(sizeof(int));
+	*snap_heap[0] = 1;
+
+	pthread_t other;
+	pthread_create(&other, NULL, snap_thread, NULL);
+	while (!snap_ready) {
+		usleep(1000);
+	}
+
+	int r = minicriu_snapshot();
+	if (r < 0) {
+		fprintf(stderr, "snapshot failed\n");
+		return 1;
+	}
+	if (r == 1) {
+		if (!snap_check(0) || !snap_check(1)) {
+			printf("rollback %d: not restored\n", snap_sh->rollbacks);
+			return 1;
+		}
+		/* stdio buffers are rolled back too */
+		printf("rollback %d ok\n", snap_sh->rollbacks);
+		fflush(stdout);
+		if (snap_sh->rollbacks == 3) {
+			munmap(snap_file, 4096);
+			if (minicriu_rollback() != -1) {
+				printf("rollback without a file mapping did not fail\n");
+				return 1;
+			}
+			printf("rollback refused ok\n");
+			return 0;
+		}
+	}
+
+	snap_dirty(0);
+	snap_go = 1;
+	while (!snap_done) {
+		usleep(1000);
+	}
+
+	++snap_sh->rollbacks;
+	minicriu_rollback();
+	fprintf(stderr, "rollback failed\n");
+	return 1;
+}
+
 int main(int argc, char *argv[]) {
 
+	if (argc == 2 && !strcmp(argv[1], "snap")) {
+		return snap_test();
+	}
+
 	signal(SIGUSR2, sighnd);
 
 	main_thread = pthread_self();